@@ -13,6 +13,160 @@
 
 #include "charger_discharger.h"
 
+/** Control ISR state, see #control_type. The members not listed start at 0*/
+__bank(CTRL_BANK) control_type      ctrl = {
+    .ss_limit = PID_Q16(DC_MIN),
+    .count = COUNTER,
+    .cmode = 1,
+    .dmode = 1,
+};
+STATIC_CHECK(ctrl_in_one_bank, sizeof(control_type) <= BANK_SIZE); ///< #ctrl must fit in one bank
+
+log_data_type                       log_data;
+bool                                SRXF = 0; ///< Serial Reception Flag
+uint16_t                            capacity; ///< Definition of capacity per cell according to each chemistry
+uint16_t                            i_char; ///< Charging current in mA
+uint16_t                            i_disc; ///< Discharging current in mA
+unsigned char                       cell_count = 1; ///< Cell counter from '1' to '4'. Initialized as '1'
+
+// last test with LI_ION gave this constants
+int32_t                             CV_kp = PID_Q24(0.0018);  ///< Proportional constant for CV mode, Q8.24
+int32_t                             CV_ki = PID_Q24(0.0005);  ///< Integral constant for CV mode, Q8.24 
+int32_t                             CV_kd = PID_Q16(0.020); ///< Diferential constant for CV mode, Q16.16 
+
+// last test with LI_ION gave this constants MAYBE OK ALEX
+int32_t                             CC_char_kp = PID_Q24(0.003);  ///< Proportional constant divider for CC mode, Q8.24
+int32_t                             CC_char_ki = PID_Q24(0.0005);  ///< Integral constant for CC mode, Q8.24 
+int32_t                             CC_disc_kp = PID_Q24(0.006);   ///< Proportional constant for CC mode, Q8.24
+int32_t                             CC_disc_ki = PID_Q24(0.001);   ///< Integral constant for CC mode, Q8.24
+uint8_t                             CC_char_disc_kd = 0;  ///< Diferential constant for CC mode 
+
+//uint16_t                            ad_res; ///< Result of an ADC measurement.
+uint8_t                             adc_sequence[ADC_SEQ_MAX] = { V_CHAN, I_CHAN, T_CHAN }; ///< Channels converted on a Timer1 tick, in order. The last one is the slow channel of the tick
+uint8_t                             adc_seq_len = ADC_SEQ_FAST; ///< Number of conversions of the present sequence
+uint16_t                            adc_sample[ADC_SEQ_FAST]; ///< Last completed conversion of each fast channel in #adc_sequence
+uint8_t                             adc_slot = ADC_SEQ_MAX; ///< Position of the conversion in progress. #adc_seq_len or more when the sequence is complete
+const uint8_t                       adc_slow_channel[ADC_SLOW_CHANNELS] = { T_CHAN, AUX_CHAN }; ///< ADC channel of every slow channel
+uint16_t                            adc_slow_period[ADC_SLOW_CHANNELS] = { ADC_TEMP_PERIOD, 0 }; ///< Timer1 ticks between conversions of every slow channel, 0 disables it. Set with ADC:RATE
+uint16_t                            adc_slow_countdown[ADC_SLOW_CHANNELS]; ///< Ticks left to the next conversion of every slow channel
+uint16_t                            adc_slow_sample[ADC_SLOW_CHANNELS]; ///< Last completed conversion of every slow channel
+uint8_t                             adc_slow_pending = ADC_SLOW_CHANNELS; ///< Slow channel of the present sequence, #ADC_SLOW_CHANNELS if none
+uint8_t                             adc_slow_next = 0; ///< First slow channel looked at on the next tick, so they take turns
+uint16_t                            adc_overrun = 0; ///< Number of Timer1 ticks where the previous sequence had not finished
+__bank(CTRL_BANK) uint16_t* const   filt_source[FILT_CHANNELS] = { &ctrl.v, &ctrl.i, &ctrl.t }; ///< Sample filtered in every channel, they all point into #ctrl
+int32_t                             filt_acum[FILT_CHANNELS]; ///< Sum of the samples of the present window, see #calculate_avg
+uint16_t                            filt_out[FILT_CHANNELS]; ///< Last filter output of every channel, in 1/16 ADC counts
+uint8_t                             filt_type = FILT_AVERAGE; ///< FILT_*, set with FILT:TYPE
+uint8_t                             filt_shift = FILT_SHIFT_MAX; ///< The window is 2^filt_shift samples, set with FILT:WIND
+uint16_t                            filt_count = (uint16_t) 1 << FILT_SHIFT_MAX; ///< Samples left to the next output
+bool                                filt_seed = 1; ///< Set to load the IIR state with the next window average
+bool                                filt_ready = 0; ///< Set when there is a new output, cleared by the main loop
+uint16_t                            vavg = 0;  ///< Last filter output of #ctrl.v, rounded to ADC counts. Initialized as 0
+uint16_t                            const_vol = 0;
+uint16_t                            iavg = 0;  ///< Last filter output of #ctrl.i, rounded to ADC counts. Initialized as 0
+uint16_t                            const_cur = 0;
+uint16_t                            tavg = 0;  ///< Last filter output of #ctrl.t, rounded to ADC counts. Initialized as 0
+cal_type                            cal[CAL_CHANNELS]; ///< Calibration of the voltage, current and temperature, see #cal_to_units
+uint16_t* const                     cal_source[CAL_CHANNELS] = { &vavg, &iavg, &tavg }; ///< One-second-average used to calibrate every channel
+uint16_t                            cal_low_counts[CAL_CHANNELS]; ///< Counts of the first calibration point of every channel
+uint16_t                            cal_low_value[CAL_CHANNELS]; ///< True value of the first calibration point of every channel
+uint32_t                            coul_acum[2]; ///< Sum of #ctrl.i while the converter runs, by direction. Taken and cleared by #coulomb_update
+uint16_t                            coul_ticks[2]; ///< Number of samples in #coul_acum
+coulomb_type                        coulomb[2]; ///< Charge and discharge totals since the converter was started
+uint16_t                            vmax = 0;   ///< Maximum recorded average voltage. 
+uint16_t                            v_prot = 0; ///< Voltage upper limit in mV, set with VOLT:PROT. 0 disables it
+uint16_t                            i_prot = 0; ///< Current upper limit in mA, set with CURR:PROT. 0 disables it
+uint16_t                            v_uvp = 0; ///< Voltage lower limit in mV, set with VOLT:PROT:LOW. 0 disables it
+uint16_t                            prot_v_high = ADC_MAX + 1; ///< #v_prot in ADC counts, #ADC_MAX + 1 when disabled. See #protection_update
+uint16_t                            prot_i_high = ADC_MAX + 1; ///< #i_prot in ADC counts, #ADC_MAX + 1 when disabled
+uint16_t                            prot_v_low = 0; ///< #v_uvp in ADC counts, 0 when disabled
+uint8_t                             prot_count[FAULT_UVP]; ///< Samples in a row beyond every limit, in the order of the FAULT_* codes
+uint8_t                             prot_debounce = PROT_DEBOUNCE; ///< Samples in a row beyond a limit that trip the protection, set with PROT:DEB
+uint8_t                             prot_fault = FAULT_NONE; ///< Latched fault, FAULT_*. Read with PROT:FAUL? and cleared with PROT:CLE
+relay_step_type                     relay_queue[RELAY_SIZE]; ///< Relay steps waiting, run by #relay_tick
+uint8_t                             relay_head = 0; ///< Next free position of #relay_queue
+uint8_t                             relay_tail = 0; ///< Next step of #relay_queue to run
+uint8_t                             relay_wait = 0; ///< Control cycles left of the guard time of the last step
+bool                                prot_pending = 0; ///< Set by #protection_tick, the main loop finishes the stop with #STOP_CONVERTER
+uint16_t                            v_endc = 0; ///< End of charge voltage in mV, set with VOLT:ENDC. 0 disables it
+uint16_t                            i_endc = 0; ///< End of charge current in mA, checked in CV mode, set with CURR:ENDC. 0 disables it
+uint16_t                            t_prot = 0; ///< Temperature that stops the converter, set with TEMP:PROT. 0 disables it
+uint16_t                            t_derate = 0; ///< Temperature where the current starts to be reduced, it reaches 0 at #t_prot. Set with TEMP:DER, 0 disables it
+uint16_t                            v_endd = 0; ///< End of discharge voltage in mV, set with VOLT:ENDD. 0 disables it
+uint8_t                             end_cause = END_NONE; ///< Why the converter was stopped, END_*
+uint8_t                             sched_mask = 0; ///< Cells of the scheduled session, bit 0 is cell #1. Set with SCHED:CELL
+bool                                sched_active = 0; ///< Set while a scheduled session is running
+cell_result_type                    cell_results[CELLS]; ///< Status, capacity and time of every cell in the session
+bool                                sched_profile = 0; ///< Run the stored profile (1) or the configured test (0) on every cell. Set with SCHED:PROF
+bool                                prof_active = 0; ///< Set while the profile is running
+uint8_t                             prof_pc = 0; ///< Index of the profile step in execution
+uint8_t                             prof_state = PROF_IDLE; ///< What the present step is waiting for, PROF_*
+uint16_t                            prof_rest = 0; ///< Seconds left of a rest step
+uint8_t                             prof_loop[PROFILE_STEPS]; ///< Iterations done by every loop step
+uint16_t                            prof_saved[3]; ///< #v_endd, #i_endc and #v_endc before the profile, the steps change them
+uint8_t                             tune_state = TUNE_IDLE; ///< Autotune progress, TUNE_*
+bool                                tune_cmode; ///< #ctrl.cmode of the tuned loop
+bool                                tune_dmode; ///< #ctrl.dmode of the tuned loop
+uint16_t                            tune_timer; ///< Control cycles left in the present phase
+uint16_t                            tune_d0; ///< Duty cycle when the identification started
+uint8_t                             tune_step; ///< Duty cycle step
+uint24_t                            tune_acum; ///< Sum of the last samples of a phase
+uint16_t                            tune_y0; ///< Feedback before the step, in ADC counts
+uint16_t                            tune_y63; ///< Feedback 63% of the way back from the step
+uint16_t                            tune_yf; ///< Filtered feedback in 1/16 ADC counts, to find the crossing of #tune_y63
+uint16_t                            tune_dy; ///< Response to the step in ADC counts
+uint16_t                            tune_tau; ///< Time constant in control cycles
+int32_t                             scpi_args[SCPI_MAX_ARGS]; ///< Numeric arguments of the last command
+uint16_t                            ff_bus = 0; ///< Bus voltage in mV used by #feedforward_start, 0 starts at #DC_MIN
+uint16_t                            ff_res = 0; ///< Resistance in mOhm between the converter and the cell, for the drop at #ctrl.i_ref
+uint16_t                            ff_slew = FF_SLEW_DEF; ///< Soft start slew in duty counts per second
+uint16_t                            ff_duty = DC_MIN; ///< Duty cycle of the last start
+uint16_t                            second = 0; ///< Seconds counter
+uint16_t                            timeout = 0;
+uint8_t                             uart_tx_buffer[UART_TX_SIZE]; ///< UART transmission ring buffer, drained by the TXIF interrupt
+volatile uint8_t                    uart_tx_head = 0; ///< Next free position of #uart_tx_buffer
+volatile uint8_t                    uart_tx_tail = 0; ///< Next position of #uart_tx_buffer to be transmitted
+uint16_t                            uart_tx_overflow = 0; ///< Number of bytes dropped because #uart_tx_buffer was full
+uint8_t                             uart_rx_buffer[UART_RX_SIZE]; ///< UART reception ring buffer, filled by the RCIF interrupt
+volatile uint8_t                    uart_rx_head = 0; ///< Next free position of #uart_rx_buffer
+volatile uint8_t                    uart_rx_tail = 0; ///< Next position of #uart_rx_buffer to be read
+uint16_t                            uart_rx_overflow = 0; ///< Number of bytes dropped because #uart_rx_buffer was full
+uint16_t                            uart_rx_overrun = 0; ///< Number of overrun errors of the UART receiver, counted by the ISR
+char                                uart_line[UART_LINE_SIZE]; ///< Command line assembled by #UART_read_until
+uint8_t                             uart_line_index = 0; ///< Number of characters already stored in #uart_line
+profile_type                        profile[PROF_STAGES]; ///< Statistics of every profiled stage, queried with DIAG:TIM?
+const char* const                   profile_names[PROF_STAGES] = { "ISR", "LAT", "ADC", "CTRL", "AVG", "TIME" }; ///< Names sent by DIAG:TIM?
+const task_type                     tasks[TASKS] = { ///< Task table, in order of priority. It is @p const so it stays in program memory
+    { task_protection,  1,              2,      "PROT" },
+    { task_measure,     16,             16,     "MEAS" },
+    { task_second,      COUL_TICKS,     64,     "SEC" },
+    { task_command,     1,              16,     "CMD" },
+    { task_telemetry,   1,              TELEM_MIN_PERIOD, "TELEM" },
+};
+log_block_type                      log_blocks[LOG_BLOCKS]; ///< RAM log of the #log_data records, written by #log_record
+log_data_type                       log_last; ///< Last record of #log_blocks, the deltas are taken from it
+uint8_t                             log_head = 0; ///< Block of #log_blocks being filled
+uint8_t                             log_used = 0; ///< Blocks of #log_blocks in use
+bool                                log_enabled = 1; ///< RAM log ON(1) or OFF(0), set with LOG:STAT
+uint8_t                             log_decimation = 1; ///< Seconds between records, set with LOG:DEC
+uint8_t                             log_countdown = 1; ///< Seconds left for the next record
+uint16_t                            log_second; ///< #second of the last record
+uint16_t                            log_sequence = 0; ///< Sequence number of the next record
+uint16_t                            log_read = 0; ///< Sequence number of the oldest record not read by the host
+uint16_t                            log_high = 0; ///< Most records waiting to be read, the high-water mark
+uint16_t                            log_lost = 0; ///< Records overwritten before they were read
+uint16_t                            task_release[TASKS]; ///< Control cycle of the next release of every task
+uint16_t                            task_missed[TASKS]; ///< Deadline misses of every task, read with DIAG:TASK?
+uint16_t                            timing_errors = 0; ///< Number of Timer1 periods where the ISR did not finish in time
+bool                                uart_line_discard = 0; ///< Set when the line is longer than #UART_LINE_SIZE, it is dropped up to the terminator
+telem_frame_type                    telem_frame; ///< Snapshot waiting to be sent by #telemetry_send
+bool                                telem_enabled = 0; ///< Binary telemetry ON(1) or OFF(0), set with TELEM:STAT
+bool                                telem_pending = 0; ///< Set when #telem_frame holds a snapshot not sent yet
+uint16_t                            telem_period = COUNTER; ///< Control cycles between frames, set with TELEM:PER. Initialized as 1 Hz
+uint16_t                            telem_countdown = COUNTER; ///< Control cycles left for the next frame
+uint8_t                             telem_sequence = 0; ///< Sequence number of the next frame
+uint16_t                            telem_dropped = 0; ///< Telemetry and status frames dropped because the UART was busy
+
 /**@brief Function to initialize all the PIC16F1787 registers
 */
 void initialize()
@@ -102,7 +256,14 @@ void initialize()
     ADCON1bits.ADPREF = 0b01; /// * Positive reference connected to VREF+
     ADCON1bits.ADFM = 1; /// * 2's compliment result
     ADCON2bits.CHSN = 0b1111; /// * Negative differential input given by ADNREF
+    ADCON0bits.CHS = adc_sequence[0]; /// * First channel of #adc_sequence selected
     ADCON0bits.ADON = 1; /// * ADC is enabled
+    TSRNG = 1; /// * High range of the temperature indicator, VDD is 5V
+    TSEN = 1; /// * Enable the temperature indicator, #AUX_CHAN
+    /** @b TIMER2 */
+    T2CON = 0x00; /// * 1:1 Prescale and postscale, Timer2 clock is FOSC/4. Timer2 is off
+    PR2 = ADC_ACQ_COUNT; /// * Set Timer2 period to the ADC acquisition time
+    TMR2 = 0;
     /** @b UART*/
     TXSEL = 0; /// * RC6 selected as TX
     RXSEL = 0; /// * RC7 selected as RX
@@ -119,394 +280,2659 @@ void initialize()
     RCIE = 0; /// * Disable UART reception interrupts
     TXIE = 0; /// * Disable UART transmission interrupts
     /** @b FINAL */
-    SET_DISC();
+    cal_reset(); /// * Set the nominal calibration by calling #cal_reset
+    config_load(); /// * Load the gains and the calibration saved in data EEPROM by calling #config_load
+    set_mode(1); /// * Set the discharge mode with #set_mode and stop the converter. The interrupts are still off, so run the relay steps with #relay_flush
+    relay_flush();
     __delay_ms(100);
     STOP_CONVERTER();
+    relay_flush();
 }
-bool command_interpreter()
+/**@brief This function compares a command line with the header of a #scpi_commands entry.
+* Each node of @p pattern is written in long form, its short form is the upper case part, so
+* "MEASure" accepts "MEAS" or "MEASURE" in any case. A ':' before the final '?' is tolerated.
+* @param pattern header of the command in long form
+* @param input command line
+* @return pointer to the arguments in @p input, or NULL if it does not match
+*/
+char* scpi_match(const char* pattern, char* input)
 {
-    bool test = true;
-    uint8_t subcommand = 0x00;
-    char data[20];
-    UART_read_until(data, ASCII_NEWLINE);
-    
-    if (0 == strcmp(data, '*IDN?'))
-    {
-        UART_send_some_char((uint8_t) strlen(ASCII_SELF), (char*) ASCII_SELF);
-    }
-    
-    subcommand = data[0];
+    uint8_t     long_len;
+    uint8_t     short_len;
+    uint8_t     len;
+    uint8_t     k;
     
-    switch (subcommand)
+    while (1)
     {
-        case 0x4D: // MEAS
-            if (data[5] == 0x56) // Voltage reading
-            {
-                
-            }
-            else if (data[5] == 0x43) // Current reading
-            {
-                
-            }
-            
-        case 0x4F: // OUTP
-            if (data[7] == 0x41) // Otput Start
-            {
-                cell_count = 0x01;
-                converter_settings();
-            }
-            else if (data[7] == 0x4F) // Output Stop
-            {
-                STOP_CONVERTER();
-            }
-            
-        case (0x43): // CURR
-            if (data[4] == 0x3A) // Set Protection
-            {
-                
-            }
-            else if (data[4] == 0x20) // Set Variable
-            {
-                //READ VALUE
-                cmode = 1;
-                i_ref = (uint16_t) ( ( ( (float) const_cur * 4096.0 ) / (5000.0 * 2.5 ) ) + 0.5 );
-            }
-            
-        case (0x56): // VOLT
-            if (data[4] == 0x3A) // Set Protection
-            {
-                
-            }
-            else if (data[4] == 0x20) // Set Variable
-            {
-                // READ VALUE
-                cmode = 0;
-                v_ref = ( ( (float) const_vol * 4096.0 ) / 5000.0 ) + 0.5 ;
-            }
-            
-        default:
-            return test = false;
+        long_len = 0; /// * For every node of @p pattern
+        short_len = 0;
+        while (pattern[long_len] && pattern[long_len] != ':' && pattern[long_len] != '?')
+        {
+            if (short_len == long_len && !islower((unsigned char) pattern[long_len])) short_len++; /// <ol> <li> Count its long and short lengths
+            long_len++;
+        }
+        len = 0;
+        while (input[len] && input[len] != ':' && input[len] != '?' && !isspace((unsigned char) input[len])) len++;
+        if (len != short_len && len != long_len) return NULL; /// <li> The input node must have one of those lengths
+        for (k = 0; k < len; k++)
+        {
+            if (toupper((unsigned char) input[k]) != toupper((unsigned char) pattern[k])) return NULL; /// <li> And the same characters </ol>
+        }
+        pattern += long_len;
+        input += len;
+        if (*pattern == ':' && *input == ':') /// * Then both must continue to the next node
+        {
+            pattern++;
+            input++;
+            continue;
+        }
+        if (*pattern == '?') /// * Or both must end as a query
+        {
+            if (input[0] == ':' && input[1] == '?') input++;
+            if (*input != '?') return NULL;
+            pattern++;
+            input++;
+        }
+        if (*pattern) return NULL; /// * Or both must end
+        if (*input && !isspace((unsigned char) *input)) return NULL;
+        return input;
     }
-    return (test);
 }
 
-/**@brief This function calls the PI control loop for current or voltage depending on the value of the #cmode variable.
+/**@brief This function parses the decimal integer arguments of a command, separated by commas, without float or @p sscanf
+* @param arg text after the command header
+* @param values where the parsed numbers are stored
+* @param count number of arguments expected
+* @return true if @p arg holds exactly @p count numbers
 */
-void control_loop()
-{   
-    if(!cmode) /// If #cmode is cleared then
-    {
-        pid(v, v_ref);/// * The #pid() function is called with @p feedback = #v and @p setpoint = #vref
-    }else /// Else,
+bool scpi_parse_numbers(const char* arg, int32_t* values, uint8_t count)
+{
+    bool        negative;
+    uint8_t     digits;
+    int32_t     number;
+    
+    while (count--) /// For every argument
     {
-        pid(i, i_ref); /// * The #pid() function is called with @p feedback = #i and @p setpoint = #iref
+        negative = false;
+        digits = 0;
+        number = 0;
+        while (isspace((unsigned char) *arg)) arg++; /// * Skip the leading spaces
+        if (*arg == '-' || *arg == '+') negative = (*arg++ == '-'); /// * Take the sign
+        while (isdigit((unsigned char) *arg)) /// * Accumulate up to #SCPI_MAX_DIGITS digits
+        {
+            if (++digits > SCPI_MAX_DIGITS) return false;
+            number = number * 10 + (*arg++ - '0');
+        }
+        if (!digits) return false;
+        *values++ = negative ? -number : number;
+        while (isspace((unsigned char) *arg)) arg++; /// * Skip the trailing spaces
+        if (count && *arg++ != ',') return false; /// * A comma must separate it from the next one
     }
-    set_DC();
+    while (isspace((unsigned char) *arg)) arg++; /// Skip the spaces after the last one, or after the header of a command without arguments
+    return (*arg == '\0'); /// Nothing else is allowed after them
 }
 
-/**@brief This function defines the PI controller
-*  @param   feedback average of measured values for the control variable
-*  @param   setpoint desire controlled output for the variable
-*/
-void pid(float feedback, float setpoint)
-{  
-    pidt += kd * (setpoint - feedback - er); /// * Calculate #diferential component of compensator
-    
-    er = setpoint - feedback; /// * Calculate the error by substract the @p feedback from the @p setpoint and store it in @p er
-    if(er > ERR_MAX) er = ERR_MAX; /// * Make sure error is never above #ERR_MAX
-    if(er < ERR_MIN) er = ERR_MIN; /// * Make sure error is never below #ERR_MIN
-    
-	pidi += (ki * er); /// * Calculate #integral component of compensator
-    pidt += (er * kp + pidi); /// * Calculate #proportional component of compensator
-    
-    if (pidt >= DC_MAX) pidt = DC_MAX;
-    else if (pidt <= DC_MIN) pidt = DC_MIN;
+/**@brief *IDN? handler, send the identification string*/
+bool scpi_idn(void* target, int32_t value)
+{
+    UART_send_string((char*) ASCII_SELF);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
 }
-/**@brief This function sets the desired duty cycle
-*/
-void set_DC()
+
+/**@brief MEASure handler, send the @p target field of #log_data*/
+bool scpi_measure(void* target, int32_t value)
 {
-/// This function can set the duty cycle from 0x0 to 0x1FF
-    uint16_t    dc = (uint16_t) pidt;
-    
-    PSMC1DCL = dc & 0x00FF; /// * Lower 8 bits of #dc are stored in @p PSMC1DCL
-    PSMC1DCH = (dc >> 8) & 0x01; /// * Higher 1 bit of #dc are stored in @p PSMC1DCH
-    PSMC1CONbits.PSMC1LD = 1; /// * Set the load register. This will load all the setting as once*/
+    UART_send_number(*(uint16_t*) target);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
 }
 
-void cc_cv_mode(uint16_t current_voltage, uint16_t reference_voltage, bool CC_mode_status)
+/**@brief MEASure:COULomb? handler, send the charge in mAs and the energy in mWs, charged and then discharged*/
+bool scpi_measure_coulomb(void* target, int32_t value)
 {
-/// If the current voltage is bigger than the CV setpoint and the system is in CC mode, then:
-    if( ( ( (uint16_t) ( ( ( (float)current_voltage * 5000.0 ) / 4096.0 ) + 0.5 ) ) > reference_voltage ) && CC_mode_status )
-    {        
-        pidi = 0;       /// <ol> <li> The integral acummulator is cleared
-        cmode = 0;      /// <li> The system is set in CV mode by clearing the #cmode variable
-        kp = CV_kp;     /// <li> The proportional constant is set to #CV_kp 
-        ki = CV_ki;     /// <li> The integral constant is set to #CV_ki
-        kd = CV_kd;     /// <li> The derivative constant is set to #CV_kd
-    }    
+    UART_send_number((int32_t) coulomb[COUL_CHARGE].charge);
+    UART_send_char(',');
+    UART_send_number((int32_t) coulomb[COUL_DISCHARGE].charge);
+    UART_send_char(',');
+    UART_send_number((int32_t) coulomb[COUL_CHARGE].energy);
+    UART_send_char(',');
+    UART_send_number((int32_t) coulomb[COUL_DISCHARGE].energy);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
 }
 
-/**@brief This function takes care of scaling the average values to correspond with their real values.
+/**@brief MEASure:ALL? handler, send every measurement in one line, so a host polling many boards needs one query
+* per board: voltage, current, capacity, temperature, #second, status (bit 0 #ctrl.cmode, bit 1 #ctrl.dmode, bit 2 #ctrl.conv) and #prot_fault
 */
-void scaling() /// This function performs the folowing tasks:
+bool scpi_measure_all(void* target, int32_t value)
 {
-    log_data.current = (uint16_t) ( ( ( (float)iavg * 2.5 * 5000.0 ) / 4096.0 ) + 0.5 ); /// <ol><li> Scale #iavg according to the 12-bit ADC resolution (4096) and the sensitivity of the sensor (0.4 V/A). 
-    log_data.voltage = (uint16_t) ( ( ( (float)vavg * 5000.0 ) / 4096.0 ) + 0.5 ); /// <li> Scale #vavg according to the 12-bit ADC resolution (4096)
-    qavg += (float)( ( ( (float)iavg * 2.5 * 5000.0 ) / 4096.0 ) + 0.5 ) / 3600.0; /// <li> Perform the discrete integration of #iavg over one second and accumulate in #qavg 
-    log_data.capacity = (uint16_t) (qavg);
+    UART_send_number(log_data.voltage);
+    UART_send_char(',');
+    UART_send_number(log_data.current);
+    UART_send_char(',');
+    UART_send_number(log_data.capacity);
+    UART_send_char(',');
+    UART_send_number(log_data.temperature);
+    UART_send_char(',');
+    UART_send_number(second);
+    UART_send_char(',');
+    UART_send_number( (ctrl.conv << 2) | (ctrl.dmode << 1) | ctrl.cmode );
+    UART_send_char(',');
+    UART_send_number(prot_fault);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
 }
 
-/**@brief This function read the ADC and store the data in the coresponding variable
-*/
-uint16_t read_ADC(uint16_t channel)
+/**@brief OUTPut:START handler, it fails while a protection fault is latched or the relays are switching*/
+bool scpi_output_start(void* target, int32_t value)
 {
-    uint16_t ad_res = 0;
-    __delay_us(10);
-    ADCON0bits.CHS = channel;
-    __delay_us(10);
-    GO_nDONE = 1;
-    while(GO_nDONE);
-    ad_res = (uint16_t)((ADRESL & 0xFF)|((ADRESH << 8) & 0xF00));
-    return ad_res;
+    if (prot_fault || !relay_ready()) return false;
+    cell_count = 0x01;
+    return converter_settings();
 }
 
-/**@brief This function control the timing
+/**@brief OUTPut:STOP handler*/
+bool scpi_output_stop(void* target, int32_t value)
+{
+    end_cause = END_USER;
+    profile_stop();
+    STOP_CONVERTER();
+    return true;
+}
+
+/**@brief CURRent handler, set the current setpoint in mA and go to CC mode*/
+bool scpi_set_current(void* target, int32_t value)
+{
+    if (value < 0 || value > UINT16_MAX) return false;
+    set_current_ref((uint16_t) value);
+    ctrl.cmode = 1;
+    set_gains();
+    return true;
+}
+
+/**@brief VOLTage handler, set the voltage setpoint in mV and go to CV mode*/
+bool scpi_set_voltage(void* target, int32_t value)
+{
+    if (value < 0 || value > UINT16_MAX) return false;
+    set_voltage_ref((uint16_t) value);
+    ctrl.cmode = 0;
+    set_gains();
+    return true;
+}
+
+/**@brief Handler for the limits, store the value in mV or mA in @p target. Zero disables the limit*/
+bool scpi_set_limit(void* target, int32_t value)
+{
+    if (value < 0 || value > UINT16_MAX) return false;
+    *(uint16_t*) target = (uint16_t) value;
+    return true;
+}
+
+/**@brief VOLTage:PROTection, VOLTage:PROTection:LOW and CURRent:PROTection handler, set the limit in @p target
+* and convert it to ADC counts for #protection_tick
 */
-void timing()
+bool scpi_set_protection(void* target, int32_t value)
+{
+    if (!scpi_set_limit(target, value)) return false;
+    protection_update();
+    return true;
+}
+
+/**@brief PROTection:DEBounce handler, set the samples in a row beyond a limit that trip the protection*/
+bool scpi_protection_debounce(void* target, int32_t value)
+{
+    if (value < 1 || value > UINT8_MAX) return false;
+    prot_debounce = (uint8_t) value;
+    return true;
+}
+
+/**@brief PROTection:FAULt? handler, send the latched fault code*/
+bool scpi_protection_fault(void* target, int32_t value)
+{
+    UART_send_number(prot_fault);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
+}
+
+/**@brief PROTection:CLEar handler, clear the latched fault so the converter can be started again*/
+bool scpi_protection_clear(void* target, int32_t value)
+{
+    prot_fault = FAULT_NONE;
+    return true;
+}
+
+/**@brief FEED:SLEW handler, set the soft start slew in duty counts per second*/
+bool scpi_feed_slew(void* target, int32_t value)
+{
+    if (value < 1 || value > DC_PERIOD) return false;
+    ff_slew = (uint16_t) value;
+    return true;
+}
+
+/**@brief TUNE:START handler, start the identification of the present loop with a duty cycle step*/
+bool scpi_tune_start(void* target, int32_t value)
+{
+    if (value < 1 || value > TUNE_STEP_MAX) return false;
+    return tune_start((uint8_t) value);
+}
+
+/**@brief TUNE:STATe? handler, send #tune_state*/
+bool scpi_tune_state(void* target, int32_t value)
+{
+    UART_send_number(tune_state);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
+}
+
+/**@brief TUNE:RESult? handler, send kp and ki in xE-6, the response in ADC counts and the time constant in cycles*/
+bool scpi_tune_result(void* target, int32_t value)
+{
+    int32_t     gain_kp;
+    int32_t     gain_ki;
+    
+    if (!tune_gains(&gain_kp, &gain_ki)) return false;
+    UART_send_number( ( (gain_kp >> 4) * 15625 + 8192 ) >> 14 ); /// * Q8.24 to xE-6 is x 10^6 / 2^24 = x 15625 / 2^18
+    UART_send_char(',');
+    UART_send_number( ( (gain_ki >> 4) * 15625 + 8192 ) >> 14 );
+    UART_send_char(',');
+    UART_send_number(tune_dy);
+    UART_send_char(',');
+    UART_send_number(tune_tau);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
+}
+
+/**@brief TUNE:APPLy handler, write the identified gains into the gains of the tuned loop and load them*/
+bool scpi_tune_apply(void* target, int32_t value)
 {
-    if(!count) /// If #count is other than zero, then
+    int32_t     gain_kp;
+    int32_t     gain_ki;
+    
+    if (!tune_gains(&gain_kp, &gain_ki)) return false;
+    if (!tune_cmode) /// * CV gains, #CV_kd is kept
     {
-        SECF = 1;
-        count = COUNTER; /// * Make #count equal to #COUNTER
-        second++; /// * always increase second, no more minutes
-    }else /// Else,
+        CV_kp = gain_kp;
+        CV_ki = gain_ki;
+    }
+    else if (tune_dmode) /// * CC discharge gains
+    {
+        CC_disc_kp = gain_kp;
+        CC_disc_ki = gain_ki;
+    }
+    else /// * CC charge gains
     {
-        count--; /// * Decrease it
+        CC_char_kp = gain_kp;
+        CC_char_ki = gain_ki;
     }
+    set_gains();
+    return true;
 }
-/**@brief This function calculate the averages
-*/
-void calculate_avg()
+
+/**@brief MODE:CHARge handler, it fails while the relays are switching, the steps would not fit in #relay_queue*/
+bool scpi_mode_char(void* target, int32_t value)
+{
+    if (!relay_ready()) return false;
+    return set_mode(0);
+}
+
+/**@brief MODE:DISCharge handler, it fails while the relays are switching*/
+bool scpi_mode_disc(void* target, int32_t value)
+{
+    if (!relay_ready()) return false;
+    return set_mode(1);
+}
+
+/**@brief CONFigure handler for the gains given in xE-6, stored in Q8.24 in @p target*/
+bool scpi_set_gain_micro(void* target, int32_t value)
+{
+    if (value < 0 || value > CONF_GAIN_MAX) return false;
+    *(int32_t*) target = PID_MICRO_TO_Q24(value);
+    set_gains();
+    return true;
+}
+
+/**@brief CONFigure handler for the gains given in xE-3, stored in Q16.16 in @p target, up to #CONF_KD_MAX*/
+bool scpi_set_gain_milli(void* target, int32_t value)
+{
+    if (value < 0 || value > CONF_KD_MAX) return false;
+    *(int32_t*) target = PID_MILLI_TO_Q16(value);
+    set_gains();
+    return true;
+}
+
+/**@brief TELEMetry:STATe handler, enable (1) or disable (0) the binary telemetry frames*/
+bool scpi_telemetry_state(void* target, int32_t value)
+{
+    if (value != 0 && value != 1) return false;
+    telem_countdown = telem_period;
+    telem_enabled = (bool) value;
+    if (!telem_enabled) telem_pending = 0; /// Drop the snapshot not sent yet, no frame follows the status of TELEM:STAT 0
+    return true;
+}
+
+/**@brief TELEMetry:PERiod handler, set the number of control cycles between frames. #COUNTER gives 1 Hz*/
+bool scpi_telemetry_period(void* target, int32_t value)
+{
+    if (value < TELEM_MIN_PERIOD || value > COUNTER) return false;
+    telem_period = (uint16_t) value;
+    return true;
+}
+
+/**@brief FILTer:TYPE handler, 0 is the window average and 1 the IIR filter*/
+bool scpi_filter_type(void* target, int32_t value)
+{
+    if (value != FILT_AVERAGE && value != FILT_IIR) return false;
+    filter_set((uint8_t) value, filt_shift);
+    return true;
+}
+
+/**@brief FILTer:WINDow handler, set the window in samples. It must be a power of two from 64 to 1024*/
+bool scpi_filter_window(void* target, int32_t value)
 {
-    switch(count)
+    uint8_t     shift;
+    
+    for (shift = FILT_SHIFT_MIN; shift <= FILT_SHIFT_MAX; shift++)
     {
-        case COUNTER: /// If #count = #COUNTER
-            iacum = (uint24_t) i; /// * Make #iavg zero
-            vacum = (uint24_t) v; /// * Make #vavg zero
-            break;
-        case 0: /// If #count = 0
-            iavg = ((iacum >> 10) + ((iacum >> 9) & 0x01)); /// * Divide the value stored in #iavg between COUNTER to obtain the average   
-            vavg = ((vacum >> 10) + ((vacum >> 9) & 0x01)); /// * This is equivalent to vacum / 1024 = vacum / 2^10 
-            break;
-        default: /// If #count is not any of the previous cases then
-            iacum += (uint24_t) i; /// * Accumulate #i in #iavg
-            vacum += (uint24_t) v; /// * Accumulate #v in #vavg
-    }   
+        if (value == ( 1L << shift )) /// * Look for the power of two
+        {
+            filter_set(filt_type, shift);
+            return true;
+        }
+    }
+    return false;
 }
 
-/**@brief Function to set the configurations of the converter.
+/**@brief ADC:RATE handler, set the Timer1 ticks between conversions of a slow channel. 0 disables it
+* @p scpi_args holds the slow channel and the ticks
 */
-void converter_settings()
+bool scpi_adc_rate(void* target, int32_t value)
 {
-    // POR VERIFICAR 
-    cmode = 1; /// * Start in constant current mode by setting. #cmode
-    pidi = 0; /// * The #integral component of the compensator is set to zero.*/
-    qavg = 0; /// * Average capacity, #q_prom is set to zero.*/
-    vmax = 0; /// * Maximum averaged voltage, #vmax is set to zero.*/
-    pidt = DC_MIN;
-    set_DC();  /// * The #set_DC() function is called
-    Cell_ON(); /// * The #Cell_ON() function is called
-    
-    // iref
-    // set_char
-    // timeout
+    bool        gie;
     
-    __delay_ms(10); 
-    second = 0;
-    conv = 1;
+    if (scpi_args[0] < 0 || scpi_args[0] >= ADC_SLOW_CHANNELS) return false;
+    if (scpi_args[1] < 0 || scpi_args[1] > UINT16_MAX) return false;
+    gie = GIE;
+    GIE = 0; /// * Disable the interrupts, the ISR uses #adc_slow_period
+    adc_slow_period[scpi_args[0]] = (uint16_t) scpi_args[1];
+    adc_slow_countdown[scpi_args[0]] = 0;
+    GIE = gie;
+    return true;
 }
 
-/**@brief This function activate the UART reception interruption 
+/**@brief DIAGnostic:TIMing? handler. Send one line per profiled stage with its name, minimum, mean and
+* maximum duration and the histogram, all in Timer1 ticks of 0.125us. The last line is the count of timing errors.
 */
-void interrupt_enable()
+bool scpi_diag_timing(void* target, int32_t value)
 {
-    char clear_buffer = 0; /// * Define the variable @p clear_buffer, used to empty the UART buffer
-    while(RCIF){
-        clear_buffer = RC1REG; /// * Clear the reception buffer and store it in @p clear_buffer
+    profile_type    p;
+    uint8_t         k;
+    uint8_t         bin;
+    uint16_t        errors;
+    bool            gie;
+    
+    for (k = 0; k < PROF_STAGES; k++)
+    {
+        gie = GIE;
+        GIE = 0; /// * Copy every stage with the interrupts disabled, so the values belong together
+        p = profile[k];
+        GIE = gie;
+        UART_wait_tx(PROF_FIELD_MAX); /// * Wait until the name fits in #uart_tx_buffer
+        UART_send_string((char*) profile_names[k]);
+        profile_send_field(p.n ? p.min : 0); /// * Send the fields with #profile_send_field, a line is longer than #uart_tx_buffer
+        profile_send_field(p.n ? (int32_t) (p.sum / p.n) : 0);
+        profile_send_field(p.max);
+        for (bin = 0; bin < PROF_BINS; bin++) profile_send_field(p.hist[bin]);
+        UART_send_char(ASCII_NEWLINE);
     }
-    RCIE = 1;           /// * Enable UART reception interrupts
-    TXIE = 0;           /// * Disable UART transmission interrupts
-    TMR1IE = 1;         //enable T1 interrupt
-    PEIE = 1;           //enable peripherals interrupts
-    GIE = 1;            //enable global interrupts
-    count = COUNTER;    /// The timing counter #count will be initialized to zero, to start a full control loop cycle
-    TMR1IF = 0;         //Clear timer1 interrupt flag
-    TMR1ON = 1;         //turn on timer 
+    gie = GIE;
+    GIE = 0; /// * Read #timing_errors with the interrupts disabled, it is written by the ISR
+    errors = timing_errors;
+    GIE = gie;
+    UART_wait_tx(PROF_FIELD_MAX);
+    UART_send_string((char*) "TERR");
+    profile_send_field(errors);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
 }
 
-/**@brief This function send one byte of data to UART
-* @param bt character to be send
-*/
-void UART_send_char(char bt)  
+/**@brief DIAGnostic:TIMing:RESet handler*/
+bool scpi_diag_timing_reset(void* target, int32_t value)
+{
+    bool        gie = GIE;
+    
+    profile_reset();
+    GIE = 0; /// * Clear #timing_errors with the interrupts disabled, it is written by the ISR
+    timing_errors = 0;
+    GIE = gie;
+    memset(task_missed, 0, sizeof(task_missed));
+    return true;
+}
+
+/**@brief DIAGnostic:TASK? handler. Send one line per task with its name, period in control cycles and deadline misses*/
+bool scpi_diag_task(void* target, int32_t value)
 {
-    while(0 == TXIF)
+    uint8_t     k;
+    
+    for (k = 0; k < TASKS; k++)
     {
-    }/// * Hold the program until the transmission buffer is free
-    TX1REG = bt; /// * Load the transmission buffer with @p bt
+        UART_wait_tx(TASK_LINE_MAX); /// * Wait until the whole line fits in #uart_tx_buffer
+        UART_send_string((char*) tasks[k].name);
+        UART_send_char(',');
+        UART_send_number(tasks[k].period);
+        UART_send_char(',');
+        UART_send_number(task_missed[k]);
+        UART_send_char(ASCII_NEWLINE);
+    }
+    return true;
 }
 
-void UART_send_header(uint8_t start, uint8_t operation, uint8_t code)
+/**@brief DIAGnostic:UART? handler, send the received bytes dropped because #uart_rx_buffer was full, the telemetry frames dropped,
+* the bytes dropped because #uart_tx_buffer was full, read with #UART_get_tx_overflow, the ADC sequences that overran a tick
+* and the overrun errors of the UART receiver*/
+bool scpi_diag_uart(void* target, int32_t value)
 {
-    UART_send_byte(start);
-    UART_send_byte(operation);
-    UART_send_byte(code);
+    uint16_t    rx_overflow;
+    uint16_t    overrun;
+    uint16_t    rx_overrun;
+    bool        gie = GIE;
+    
+    GIE = 0; /// * Read #uart_rx_overflow, #adc_overrun and #uart_rx_overrun with the interrupts disabled, they are written by the ISR
+    rx_overflow = uart_rx_overflow;
+    overrun = adc_overrun;
+    rx_overrun = uart_rx_overrun;
+    GIE = gie;
+    UART_send_number(rx_overflow);
+    UART_send_char(',');
+    UART_send_number(telem_dropped);
+    UART_send_char(',');
+    UART_send_number(UART_get_tx_overflow());
+    UART_send_char(',');
+    UART_send_number(overrun);
+    UART_send_char(',');
+    UART_send_number(rx_overrun);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
 }
 
-/**@brief This function receive one byte of data from UART
-* @return RC1REG reception register
-*/
-uint8_t UART_get_byte()
+/**@brief SCHEDule:CELLs handler, select the cells of the session with a bit mask, bit 0 is cell #1*/
+bool scpi_sched_cells(void* target, int32_t value)
 {
-    if(OERR) /// If there is error
-    {
-        CREN = 0; /// * Clear the error
-        CREN = 1; /// * Restart
-    }    
-    while(!RCIF);  /// Hold the program until the reception buffer is free   
-    return RC1REG; /// Receive the value and return it
+    if (value < 1 || value > CELLS_MASK || sched_active) return false;
+    sched_mask = (uint8_t) value;
+    return true;
+}
+
+/**@brief SCHEDule:START handler, it fails while the relays are switching or if the first cell does not start*/
+bool scpi_sched_start(void* target, int32_t value)
+{
+    if (sched_active || ctrl.conv || !relay_ready()) return false;
+    return scheduler_start();
+}
+
+/**@brief SCHEDule:STOP handler, stop the converter and the session*/
+bool scpi_sched_stop(void* target, int32_t value)
+{
+    if (!sched_active) return false;
+    end_cause = END_USER;
+    STOP_CONVERTER();
+    scheduler_update();
+    return true;
 }
 
-void UART_get_some_bytes(uint8_t length, uint8_t* data)
+/**@brief SCHEDule:RESult? handler, send one line per cell with its number, status, capacity in mAh and time in seconds*/
+bool scpi_sched_result(void* target, int32_t value)
 {
-    if(OERR) /// If there is error
+    uint8_t     k;
+    
+    for (k = 0; k < CELLS; k++)
     {
-        CREN = 0; /// * Clear the error
-        CREN = 1; /// * Restart
-    }    
-    while(length--)
+        UART_wait_tx(SCHED_LINE_MAX);
+        UART_send_number(k + 1);
+        UART_send_char(',');
+        UART_send_number(cell_results[k].status);
+        UART_send_char(',');
+        UART_send_number(cell_results[k].capacity);
+        UART_send_char(',');
+        UART_send_number(cell_results[k].time);
+        UART_send_char(ASCII_NEWLINE);
+    }
+    return true;
+}
+
+/**@brief LOG:DATA? handler, send up to #LOG_BURST records of the RAM log from the sequence number @p value, one line each:
+* sequence, second, voltage, current, capacity, temperature. The records before @p value are taken as read
+*/
+bool scpi_log_data(void* target, int32_t value)
+{
+    uint16_t            from = (uint16_t) value;
+    uint8_t             index = (uint8_t) (log_head + 1 - log_used) & LOG_MASK;
+    uint8_t             n, k, f;
+    uint8_t             sent = 0;
+    log_block_type*     b;
+    log_data_type       rec;
+    uint16_t            sec;
+    
+    if (value < 0 || value > UINT16_MAX) return false;
+    if ( (int16_t) (from - log_read) > 0 && (int16_t) (log_sequence - from) >= 0 ) log_read = from;
+    for (n = 0; n < log_used; n++)
     {
-        *data++ = UART_get_byte(); /// * Get a byte      
+        b = &log_blocks[index];
+        rec = b->first;
+        sec = b->second;
+        for (k = 0; k < b->count && sent < LOG_BURST; k++)
+        {
+            if (k) /// Add the changes to the record before
+            {
+                f = k - 1;
+                rec.voltage += b->delta[f].voltage;
+                rec.current += b->delta[f].current;
+                rec.capacity += (int8_t) b->delta[f].slow >> 4; /// The nibbles are sign extended by the arithmetic shift
+                rec.temperature += (int8_t) (b->delta[f].slow << 4) >> 4;
+                sec += b->decimation;
+            }
+            if ( (int16_t) (b->sequence + k - from) < 0 ) continue;
+            UART_wait_tx(LOG_LINE_MAX);
+            UART_send_number(b->sequence + k);
+            UART_send_char(',');
+            UART_send_number(sec);
+            UART_send_char(',');
+            UART_send_number(rec.voltage);
+            UART_send_char(',');
+            UART_send_number(rec.current);
+            UART_send_char(',');
+            UART_send_number(rec.capacity);
+            UART_send_char(',');
+            UART_send_number(rec.temperature);
+            UART_send_char(ASCII_NEWLINE);
+            sent++;
+        }
+        index = (index + 1) & LOG_MASK;
     }
+    return true;
+}
+
+/**@brief LOG:STATus? handler, send the oldest sequence number kept, the next one, the high-water mark and the records lost*/
+bool scpi_log_status(void* target, int32_t value)
+{
+    UART_send_number(log_used ? log_blocks[(uint8_t) (log_head + 1 - log_used) & LOG_MASK].sequence : log_sequence);
+    UART_send_char(',');
+    UART_send_number(log_sequence);
+    UART_send_char(',');
+    UART_send_number(log_high);
+    UART_send_char(',');
+    UART_send_number(log_lost);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
 }
 
-// Function to read ASCII characters from UART until a terminator is found
-void UART_read_until(char *data, char terminator)
+/**@brief LOG:STATe handler, turn the RAM log on (1) or off (0)*/
+bool scpi_log_state(void* target, int32_t value)
 {
-    int index = 0;
-    char received_byte;
+    if (value < 0 || value > 1) return false;
+    log_enabled = (bool) value;
+    return true;
+}
 
-    while (index < 20 - 1) { // Leave space for null terminator
-        received_byte = UART_get_byte(); // Read a byte from UART
+/**@brief LOG:DECimation handler, set the seconds between records, from 1 to 255*/
+bool scpi_log_decimation(void* target, int32_t value)
+{
+    if (value < 1 || value > UINT8_MAX) return false;
+    log_decimation = (uint8_t) value;
+    log_countdown = 1;
+    return true;
+}
 
-        // Check if the received byte is the terminator
-        if (received_byte == terminator) {
-            break; // Exit the loop if the terminator is received
-        }
+/**@brief LOG:CLEar handler, empty the RAM log*/
+bool scpi_log_clear(void* target, int32_t value)
+{
+    log_clear();
+    return true;
+}
 
-        data[index++] = received_byte; // Store the byte in the buffer
-    }
+/**@brief PROFile:STEP handler, store a step in the data EEPROM. Arguments: index, code, arg1, arg2*/
+bool scpi_profile_step(void* target, int32_t value)
+{
+    profile_step_type   step;
+    
+    if (prof_active) return false;
+    if (scpi_args[0] < 0 || scpi_args[0] >= PROFILE_STEPS) return false;
+    if (scpi_args[1] < 0 || scpi_args[1] > PROF_OP_LAST) return false;
+    if (scpi_args[2] < 0 || scpi_args[2] > UINT16_MAX || scpi_args[3] < 0 || scpi_args[3] > UINT16_MAX) return false;
+    if (scpi_args[1] == PROF_OP_LOOP && scpi_args[3] > UINT8_MAX) return false; /// The repetitions are counted in #prof_loop, 8-bit
+    step.op = (uint8_t) scpi_args[1];
+    step.arg1 = (uint16_t) scpi_args[2];
+    step.arg2 = (uint16_t) scpi_args[3];
+    profile_write_step((uint8_t) scpi_args[0], &step);
+    return true;
+}
 
-    data[index] = '\0'; // Null-terminate the string
+/**@brief PROFile:STEP? handler, send the step at the given index as "code,arg1,arg2"*/
+bool scpi_profile_step_query(void* target, int32_t value)
+{
+    profile_step_type   step;
+    
+    if (value < 0 || value >= PROFILE_STEPS) return false;
+    profile_read_step((uint8_t) value, &step);
+    UART_send_number(step.op);
+    UART_send_char(',');
+    UART_send_number(step.arg1);
+    UART_send_char(',');
+    UART_send_number(step.arg2);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
 }
 
-void UART_send_byte(uint8_t byte)  
+/**@brief PROFile:RUN handler, it fails while the relays are switching or if the first steps can not be run*/
+bool scpi_profile_run(void* target, int32_t value)
 {
-    while(0 == TXIF)
-    {
-    }/// * Hold the program until the transmission buffer is free
-    TX1REG = byte; /// * Load the transmission buffer with @p bt
+    if (prof_active || ctrl.conv || sched_active || !relay_ready()) return false;
+    return profile_start();
 }
 
-void UART_send_some_bytes(uint8_t length, uint8_t* data)
+/**@brief PROFile:STOP handler, stop the profile and the converter*/
+bool scpi_profile_stop(void* target, int32_t value)
 {
-    while(length--)
-    {
-        UART_send_byte(*data++); /// * send a byte      
-    }
+    if (!prof_active) return false;
+    profile_stop();
+    end_cause = END_USER;
+    STOP_CONVERTER();
+    return true;
 }
 
-void UART_send_some_char(uint8_t length, char* data)
+/**@brief PROFile:STATe? handler, send "active,step,state,rest" */
+bool scpi_profile_state(void* target, int32_t value)
 {
-    while(length--)
-    {
-        UART_send_byte((uint8_t)*data++); /// * send a byte      
-    }
+    UART_send_number(prof_active);
+    UART_send_char(',');
+    UART_send_number(prof_pc);
+    UART_send_char(',');
+    UART_send_number(prof_state);
+    UART_send_char(',');
+    UART_send_number(prof_rest);
+    UART_send_char(ASCII_NEWLINE);
+    return true;
 }
 
-void put_data_into_structure(uint8_t length, uint8_t* data, uint8_t* structure)
+/**@brief SCHEDule:PROFile handler, run the stored profile (1) or the configured test (0) on every cell of a session*/
+bool scpi_sched_profile(void* target, int32_t value)
 {
-    while(length--)
+    if (value != 0 && value != 1) return false;
+    sched_profile = (bool) value;
+    return true;
+}
+
+/**@brief CONFigure:SAVE handler, store the gains and the calibration in data EEPROM*/
+bool scpi_config_save(void* target, int32_t value)
+{
+    config_save();
+    return true;
+}
+
+/**@brief CONFigure:RECall handler, load the gains and the calibration saved in data EEPROM*/
+bool scpi_config_recall(void* target, int32_t value)
+{
+    return config_load();
+}
+
+/**@brief CALibrate:<channel>:LOW handler. Store the present one-second-average of the channel in @p target as
+* the first calibration point, together with the true value measured by the reference instrument.
+*/
+bool scpi_cal_low(void* target, int32_t value)
+{
+    uint8_t     channel = (uint8_t) ( (cal_type*) target - cal );
+    
+    if (value < 0 || value > UINT16_MAX) return false;
+    cal_low_counts[channel] = *cal_source[channel];
+    cal_low_value[channel] = (uint16_t) value;
+    return true;
+}
+
+/**@brief CALibrate:<channel>:HIGH handler. Take the second calibration point and calculate the gain and
+* offset of the channel in @p target from both points.
+*/
+bool scpi_cal_high(void* target, int32_t value)
+{
+    uint8_t     channel = (uint8_t) ( (cal_type*) target - cal );
+    uint16_t    counts = *cal_source[channel];
+    int32_t     gain;
+    int32_t     offset;
+    
+    if (value < 0 || value > UINT16_MAX) return false;
+    if (counts <= cal_low_counts[channel] || value <= cal_low_value[channel]) return false; /// * The points must be different and in order
+    gain = ( ( (value - cal_low_value[channel]) << CAL_SHIFT ) + ( (counts - cal_low_counts[channel]) >> 1 ) ) / (counts - cal_low_counts[channel]); /// * gain = 4096 x dValue / dCounts
+    if (gain < 1 || gain > UINT16_MAX) return false;
+    offset = (int32_t) cal_low_value[channel] - ( ( (int32_t) cal_low_counts[channel] * gain + CAL_ROUND ) >> CAL_SHIFT ); /// * offset from the first point
+    if (offset < INT16_MIN || offset > INT16_MAX) return false;
+    cal[channel].gain = (uint16_t) gain;
+    cal[channel].offset = (int16_t) offset;
+    set_current_ref(const_cur); /// * Scale the setpoints and the protection limits again with the new calibration
+    set_voltage_ref(const_vol);
+    protection_update();
+    return true;
+}
+
+/**@brief CALibrate:RESet handler, go back to the nominal calibration*/
+bool scpi_cal_reset(void* target, int32_t value)
+{
+    cal_reset();
+    set_current_ref(const_cur);
+    set_voltage_ref(const_vol);
+    protection_update();
+    return true;
+}
+
+/**@brief CALibrate:DATA? handler, send the offset and gain of every channel: V, I and T*/
+bool scpi_cal_data(void* target, int32_t value)
+{
+    uint8_t     k;
+    
+    for (k = 0; k < CAL_CHANNELS; k++)
     {
-        *structure++ = *data++;
+        UART_send_number(cal[k].offset);
+        UART_send_char(',');
+        UART_send_number(cal[k].gain);
+        UART_send_char(ASCII_NEWLINE);
     }
+    return true;
 }
 
-/**@brief This function send a string using UART
-* @param st_pt pointer to string to be send
+/** Command table, see changes_2024.md. It is @p const so it stays in program memory*/
+const scpi_command_type scpi_commands[] = {
+    { "*IDN?",                  scpi_idn,               NULL,                   0 },
+    { "MEASure:VOLTage?",       scpi_measure,           &log_data.voltage,      0 },
+    { "MEASure:CURRent?",       scpi_measure,           &log_data.current,      0 },
+    { "MEASure:CAPacity?",      scpi_measure,           &log_data.capacity,     0 },
+    { "MEASure:ALL?",           scpi_measure_all,       NULL,                   0 },
+    { "MEASure:COULomb?",       scpi_measure_coulomb,   NULL,                   0 },
+    { "OUTPut:START",           scpi_output_start,      NULL,                   0 },
+    { "OUTPut:STOP",            scpi_output_stop,       NULL,                   0 },
+    { "VOLTage",                scpi_set_voltage,       NULL,                   SCPI_ARG },
+    { "CURRent",                scpi_set_current,       NULL,                   SCPI_ARG },
+    { "VOLTage:PROTection",     scpi_set_protection,    &v_prot,                SCPI_ARG },
+    { "VOLTage:PROTection:LOW", scpi_set_protection,    &v_uvp,                 SCPI_ARG },
+    { "CURRent:PROTection",     scpi_set_protection,    &i_prot,                SCPI_ARG },
+    { "PROTection:DEBounce",    scpi_protection_debounce, NULL,                 SCPI_ARG },
+    { "PROTection:FAULt?",      scpi_protection_fault,  NULL,                   0 },
+    { "PROTection:CLEar",       scpi_protection_clear,  NULL,                   0 },
+    { "MODE:CHARge",            scpi_mode_char,         NULL,                   0 },
+    { "MODE:DISCharge",         scpi_mode_disc,         NULL,                   0 },
+    { "VOLTage:ENDCharge",      scpi_set_limit,         &v_endc,                SCPI_ARG },
+    { "CURRent:ENDCharge",      scpi_set_limit,         &i_endc,                SCPI_ARG },
+    { "VOLTage:ENDDischarge",   scpi_set_limit,         &v_endd,                SCPI_ARG },
+    { "CONFigure:CVKP",         scpi_set_gain_micro,    &CV_kp,                 SCPI_ARG },
+    { "CONFigure:CVKI",         scpi_set_gain_micro,    &CV_ki,                 SCPI_ARG },
+    { "CONFigure:CVKD",         scpi_set_gain_milli,    &CV_kd,                 SCPI_ARG },
+    { "CONFigure:CCCP",         scpi_set_gain_micro,    &CC_char_kp,            SCPI_ARG },
+    { "CONFigure:CCCI",         scpi_set_gain_micro,    &CC_char_ki,            SCPI_ARG },
+    { "CONFigure:CCDP",         scpi_set_gain_micro,    &CC_disc_kp,            SCPI_ARG },
+    { "CONFigure:CCDI",         scpi_set_gain_micro,    &CC_disc_ki,            SCPI_ARG },
+    { "FEED:BUS",               scpi_set_limit,         &ff_bus,                SCPI_ARG },
+    { "FEED:RESistance",        scpi_set_limit,         &ff_res,                SCPI_ARG },
+    { "FEED:SLEW",              scpi_feed_slew,         NULL,                   SCPI_ARG },
+    { "FEED:DUTY?",             scpi_measure,           &ff_duty,               0 },
+    { "TUNE:START",             scpi_tune_start,        NULL,                   SCPI_ARG },
+    { "TUNE:STATe?",            scpi_tune_state,        NULL,                   0 },
+    { "TUNE:RESult?",           scpi_tune_result,       NULL,                   0 },
+    { "TUNE:APPLy",             scpi_tune_apply,        NULL,                   0 },
+    { "CALibrate:VOLTage:LOW",  scpi_cal_low,           &cal[CAL_V],            SCPI_ARG },
+    { "CALibrate:VOLTage:HIGH", scpi_cal_high,          &cal[CAL_V],            SCPI_ARG },
+    { "CALibrate:CURRent:LOW",  scpi_cal_low,           &cal[CAL_I],            SCPI_ARG },
+    { "CALibrate:CURRent:HIGH", scpi_cal_high,          &cal[CAL_I],            SCPI_ARG },
+    { "CALibrate:TEMPerature:LOW", scpi_cal_low,        &cal[CAL_T],            SCPI_ARG },
+    { "CALibrate:TEMPerature:HIGH", scpi_cal_high,      &cal[CAL_T],            SCPI_ARG },
+    { "CALibrate:RESet",        scpi_cal_reset,         NULL,                   0 },
+    { "CALibrate:DATA?",        scpi_cal_data,          NULL,                   0 },
+    { "CONFigure:SAVE",         scpi_config_save,       NULL,                   0 },
+    { "CONFigure:RECall",       scpi_config_recall,     NULL,                   0 },
+    { "TELEMetry:STATe",        scpi_telemetry_state,   NULL,                   SCPI_ARG },
+    { "TELEMetry:PERiod",       scpi_telemetry_period,  NULL,                   SCPI_ARG },
+    { "TEMPerature:PROTection", scpi_set_limit,         &t_prot,                SCPI_ARG },
+    { "TEMPerature:DERating",   scpi_set_limit,         &t_derate,              SCPI_ARG },
+    { "MEASure:TEMPerature?",   scpi_measure,           &log_data.temperature,  0 },
+    { "ADC:RATE",               scpi_adc_rate,          NULL,                   SCPI_ARG2 },
+    { "FILTer:TYPE",            scpi_filter_type,       NULL,                   SCPI_ARG },
+    { "FILTer:WINDow",          scpi_filter_window,     NULL,                   SCPI_ARG },
+    { "SCHEDule:CELLs",         scpi_sched_cells,       NULL,                   SCPI_ARG },
+    { "SCHEDule:START",         scpi_sched_start,       NULL,                   0 },
+    { "SCHEDule:STOP",          scpi_sched_stop,        NULL,                   0 },
+    { "SCHEDule:RESult?",       scpi_sched_result,      NULL,                   0 },
+    { "SCHEDule:PROFile",       scpi_sched_profile,     NULL,                   SCPI_ARG },
+    { "PROFile:STEP",           scpi_profile_step,      NULL,                   SCPI_ARG4 },
+    { "PROFile:STEP?",          scpi_profile_step_query,NULL,                   SCPI_ARG },
+    { "PROFile:RUN",            scpi_profile_run,       NULL,                   0 },
+    { "PROFile:STOP",           scpi_profile_stop,      NULL,                   0 },
+    { "PROFile:STATe?",         scpi_profile_state,     NULL,                   0 },
+    { "LOG:DATA?",              scpi_log_data,          NULL,                   SCPI_ARG },
+    { "LOG:STATus?",            scpi_log_status,        NULL,                   0 },
+    { "LOG:STATe",              scpi_log_state,         NULL,                   SCPI_ARG },
+    { "LOG:DECimation",         scpi_log_decimation,    NULL,                   SCPI_ARG },
+    { "LOG:CLEar",              scpi_log_clear,         NULL,                   0 },
+    { "DIAGnostic:TIMing?",     scpi_diag_timing,       NULL,                   0 },
+    { "DIAGnostic:TIMing:RESet",scpi_diag_timing_reset, NULL,                   0 },
+    { "DIAGnostic:TASK?",       scpi_diag_task,         NULL,                   0 },
+    { "DIAGnostic:UART?",       scpi_diag_uart,         NULL,                   0 },
+};
+const uint8_t                       scpi_command_count = sizeof(scpi_commands) / sizeof(scpi_commands[0]); ///< Number of entries of #scpi_commands
+
+/**@brief This function executes one command line assembled by #UART_read_until
+* @param data null terminated command line
+* @return true if the command was found and executed
 */
-void UART_send_string(char* st_pt)
+bool command_interpreter(char* data)
 {
-    while(*st_pt) /// While there is a byte to send
-        UART_send_char(*st_pt++); /// * Send it using #UART_send_char() and then increase the pointer possition
-}
-
-/**@brief This function activate the desired relay in the switcher board according to the value
-* of #cell_count
-*/
-void Cell_ON()
-{
-    if (cell_count == 1) /// If cell_count = '1'
-    {
-        CELL1_ON(); /// * Turn ON cell #1 by calling #CELL1_ON
-        __delay_ms(10);
-        CELL2_OFF(); /// * Turn OFF cell #2 by calling #CELL2_OFF
-        __delay_ms(10);        
-        CELL3_OFF(); /// * Turn OFF cell #3 by calling #CELL3_OFF
-        __delay_ms(10);
-        CELL4_OFF(); /// * Turn OFF cell #4 by calling #CELL4_OFF
-        __delay_ms(10);
-    }else if (cell_count == 2)
-    {
-        CELL1_OFF(); /// * Turn OFF cell #1 by calling #CELL1_OFF
-        __delay_ms(10);
-        CELL2_ON(); /// * Turn ON cell #2 by calling #CELL2_ON
-        __delay_ms(10);
-        CELL3_OFF(); /// * Turn OFF cell #3 by calling #CELL3_OFF
-        __delay_ms(10);
-        CELL4_OFF(); /// * Turn OFF cell #4 by calling #CELL4_OFF
-        __delay_ms(10);
-    }else if (cell_count == 3)
-    {
-        CELL1_OFF(); /// * Turn OFF cell #1 by calling #CELL1_OFF
-        __delay_ms(10);
-        CELL2_OFF(); /// * Turn OFF cell #2 by calling #CELL2_OFF
-        __delay_ms(10);
-        CELL3_ON(); /// * Turn ON cell #3 by calling #CELL3_ON
-        __delay_ms(10);
-        CELL4_OFF(); /// * Turn OFF cell #4 by calling #CELL4_OFF    
-    }else if (cell_count == 4)
-    {
-        CELL1_OFF(); /// * Turn OFF cell #1 by calling #CELL1_OFF
-        __delay_ms(10);
-        CELL2_OFF(); /// * Turn OFF cell #2 by calling #CELL2_OFF
-        __delay_ms(10);
-        CELL3_OFF(); /// * Turn OFF cell #3 by calling #CELL3_OFF
-        __delay_ms(10);
-        CELL4_ON(); /// * Turn ON cell #4 by calling #CELL4_ON
-        __delay_ms(10);
-    }
-}
-/**@brief This function deactivate all relays in the switcher board
+    uint8_t     k;
+    char*       arg;
+    
+    for (k = 0; k < scpi_command_count; k++) /// For every entry of #scpi_commands
+    {
+        arg = scpi_match(scpi_commands[k].pattern, data); /// * Compare the header with #scpi_match
+        if (arg == NULL) continue;
+        if (telem_enabled && scpi_commands[k].pattern[strlen(scpi_commands[k].pattern) - 1] == '?') return false; /// * Refuse a query while the telemetry is on, its text would mix with the frames
+        scpi_args[0] = 0;
+        if (!scpi_parse_numbers(arg, scpi_args, scpi_commands[k].flags & SCPI_ARGS_MASK)) return false; /// * If it matches, parse the arguments into #scpi_args
+        return scpi_commands[k].handler(scpi_commands[k].target, scpi_args[0]); /// * And call the handler with the first one
+    }
+    return false;
+}
+
+/**@brief This function loads #ctrl.kp, #ctrl.ki and #ctrl.kd with the gains of the present mode
 */
-void Cell_OFF()
+void set_gains()
 {
-    CELL1_OFF(); /// * Turn OFF cell #1 by calling #CELL1_OFF
-    __delay_ms(10);
-    CELL2_OFF(); /// * Turn OFF cell #2 by calling #CELL2_OFF
-    __delay_ms(10);
-    CELL3_OFF(); /// * Turn OFF cell #3 by calling #CELL3_OFF
-    __delay_ms(10);
-    CELL4_OFF(); /// * Turn OFF cell #4 by calling #CELL4_OFF  
-    __delay_ms(10);
-}
\ No newline at end of file
+    bool        gie = GIE;
+    
+    GIE = 0; /// * Disable the interrupts, the gains are used by the ISR
+    if (!ctrl.cmode) /// * CV mode uses #CV_kp, #CV_ki and #CV_kd
+    {
+        ctrl.kp = CV_kp;
+        ctrl.ki = CV_ki;
+        ctrl.kd = CV_kd;
+    }
+    else if (ctrl.dmode) /// * CC discharge uses #CC_disc_kp and #CC_disc_ki
+    {
+        ctrl.kp = CC_disc_kp;
+        ctrl.ki = CC_disc_ki;
+        ctrl.kd = (int32_t) CC_char_disc_kd << 16;
+    }
+    else /// * CC charge uses #CC_char_kp and #CC_char_ki
+    {
+        ctrl.kp = CC_char_kp;
+        ctrl.ki = CC_char_ki;
+        ctrl.kd = (int32_t) CC_char_disc_kd << 16;
+    }
+    /// * Limit the gains to #PID_K_MAX and #PID_KD_MAX, above them the products of #pid overflow. It covers the gains loaded from the EEPROM too
+    if (ctrl.kp > PID_K_MAX) ctrl.kp = PID_K_MAX;
+    else if (ctrl.kp < 0) ctrl.kp = 0;
+    if (ctrl.ki > PID_K_MAX) ctrl.ki = PID_K_MAX;
+    else if (ctrl.ki < 0) ctrl.ki = 0;
+    if (ctrl.kd > PID_KD_MAX) ctrl.kd = PID_KD_MAX;
+    else if (ctrl.kd < 0) ctrl.kd = 0;
+    GIE = gie;
+}
+
+/**@brief This function selects the charge or discharge mode: it queues the mode relays with #relay_mode and loads the gains
+* @param discharge 1 for discharge, 0 for charge
+* @return false if the relay steps do not fit in #relay_queue, then the mode is not changed
+*/
+bool set_mode(bool discharge)
+{
+    if (!relay_mode(discharge)) return false;
+    ctrl.dmode = discharge;
+    set_gains();
+    ctrl.pidi = 0;
+    return true;
+}
+
+/**@brief This function checks the end of test limits once per second. A limit set to zero is disabled.
+* The protection limits are checked on every sample by #protection_tick.
+*/
+void check_limits()
+{
+    if (!ctrl.conv) return; /// Only when the converter is running
+    if (!ctrl.dmode) /// * When charging, stop at #v_endc, or at #i_endc once in CV mode
+    {
+        if ( (v_endc && log_data.voltage >= v_endc) || (i_endc && !ctrl.cmode && log_data.current <= i_endc) )
+        {
+            end_cause = END_LIMIT;
+            STOP_CONVERTER();
+        }
+    }
+    else /// * When discharging, stop at #v_endd
+    {
+        if (v_endd && log_data.voltage <= v_endd)
+        {
+            end_cause = END_LIMIT;
+            STOP_CONVERTER();
+        }
+    }
+}
+
+/**@brief This function converts the protection limits from mV and mA to ADC counts, so #protection_tick
+* compares the raw samples. It is called when a limit or the calibration changes and when the converter starts.
+*/
+void protection_update()
+{
+    uint16_t    v_high = v_prot ? cal_from_units(CAL_V, v_prot) : ADC_MAX + 1;
+    uint16_t    i_high = i_prot ? cal_from_units(CAL_I, i_prot) : ADC_MAX + 1;
+    uint16_t    v_low = v_uvp ? cal_from_units(CAL_V, v_uvp) : 0;
+    bool        gie = GIE;
+    
+    GIE = 0; /// * Disable the interrupts, the limits are used by the ISR
+    prot_v_high = v_high;
+    prot_i_high = i_high;
+    prot_v_low = v_low;
+    GIE = gie;
+}
+
+/**@brief This function checks the protection limits on every sample, it is called from #control_sample while the converter runs.
+* When a limit is exceeded for #prot_debounce samples in a row, the converter is turned off at once with #CONVERTER_OFF,
+* the fault is latched in #prot_fault and the main loop turns off the cell relays.
+*/
+void protection_tick()
+{
+    uint8_t     fault = FAULT_NONE;
+    
+    if (ctrl.v > prot_v_high) /// * Over-voltage, #ctrl.v above #prot_v_high
+    {
+        if (++prot_count[FAULT_OVP - 1] >= prot_debounce) fault = FAULT_OVP;
+    }
+    else prot_count[FAULT_OVP - 1] = 0;
+    if (ctrl.i > prot_i_high) /// * Over-current, #ctrl.i above #prot_i_high
+    {
+        if (++prot_count[FAULT_OCP - 1] >= prot_debounce) fault = FAULT_OCP;
+    }
+    else prot_count[FAULT_OCP - 1] = 0;
+    if (ctrl.v < prot_v_low) /// * Under-voltage, #ctrl.v below #prot_v_low
+    {
+        if (++prot_count[FAULT_UVP - 1] >= prot_debounce) fault = FAULT_UVP;
+    }
+    else prot_count[FAULT_UVP - 1] = 0;
+    if (fault) /// * On a fault, turn off the converter and latch it
+    {
+        CONVERTER_OFF();
+        prot_fault = fault;
+        end_cause = END_PROT;
+        prot_pending = 1;
+        memset(prot_count, 0, sizeof(prot_count));
+    }
+}
+
+/**@brief This function starts the identification of the present loop: #ctrl.cmode selects current or voltage and #ctrl.dmode
+* charge or discharge. The converter must be running, the loop is opened and the duty cycle is stepped.
+* @param step duty cycle step, up to #TUNE_STEP_MAX
+* @return false if the converter is off or the step does not fit below #DC_MAX
+*/
+bool tune_start(uint8_t step)
+{
+    bool        gie;
+    uint16_t    d0;
+    
+    if (!ctrl.conv || !step || step > TUNE_STEP_MAX) return false;
+    gie = GIE;
+    GIE = 0; /// * Disable the interrupts, the identification is run by the ISR
+    d0 = (uint16_t) (ctrl.pidt >> 16);
+    if (d0 + step > DC_MAX)
+    {
+        GIE = gie;
+        return false;
+    }
+    tune_d0 = d0; /// * Hold the present duty cycle
+    tune_step = step;
+    tune_cmode = ctrl.cmode;
+    tune_dmode = ctrl.dmode;
+    tune_acum = 0;
+    tune_timer = TUNE_PHASE;
+    tune_state = TUNE_SETTLE;
+    GIE = gie;
+    return true;
+}
+
+/**@brief This function runs the autotune step response instead of #control_loop, it is called from #control_sample.
+* Every phase lasts #TUNE_PHASE cycles and averages its last samples:
+* <ol> <li> #TUNE_SETTLE holds #tune_d0 and measures #tune_y0
+* <li> #TUNE_STEP applies #tune_d0 + #tune_step and measures the response #tune_dy
+* <li> #TUNE_RETURN goes back to #tune_d0 and counts the cycles until the feedback falls 63% of #tune_dy, the time constant #tune_tau </ol>
+* Then the loop is closed again from #tune_d0.
+*/
+void tune_tick()
+{
+    uint16_t    y = tune_cmode ? ctrl.i : ctrl.v;
+    uint16_t    y1;
+    
+    if (tune_cmode != ctrl.cmode || tune_dmode != ctrl.dmode) /// * Give up if the mode changed
+    {
+        tune_state = TUNE_FAIL;
+        return;
+    }
+    tune_yf = (uint16_t) ( tune_yf + ( ( ( (int32_t) y << 4 ) - tune_yf ) >> 2 ) ); /// * Filter the feedback for the crossing detection
+    if (tune_state == TUNE_RETURN && !tune_tau && tune_yf <= tune_y63 << 4) /// * Take the time of the crossing without the delay of the filter
+    {
+        tune_tau = TUNE_PHASE - tune_timer + 1;
+        tune_tau = (tune_tau > TUNE_FILTER_LAG) ? tune_tau - TUNE_FILTER_LAG : 1;
+    }
+    if (tune_timer <= (1 << TUNE_AVG_SHIFT)) tune_acum += y; /// * Average the last samples of the phase
+    if (--tune_timer) return;
+    
+    y1 = (uint16_t) ( (tune_acum + (1 << (TUNE_AVG_SHIFT - 1))) >> TUNE_AVG_SHIFT );
+    tune_acum = 0;
+    tune_timer = TUNE_PHASE;
+    switch (tune_state) /// * At the end of every phase:
+    {
+        case TUNE_SETTLE: /// <ul> <li> Store #tune_y0 and step the duty cycle
+            tune_y0 = y1;
+            set_DC(tune_d0 + tune_step);
+            tune_state = TUNE_STEP;
+            break;
+        case TUNE_STEP: /// <li> Store #tune_dy, calculate #tune_y63 and go back to #tune_d0
+            if (y1 < tune_y0 + TUNE_DY_MIN)
+            {
+                tune_state = TUNE_FAIL;
+                break;
+            }
+            tune_dy = y1 - tune_y0;
+            tune_y63 = tune_y0 + (uint16_t) ( ( (uint32_t) tune_dy * 377 ) >> 10 );
+            tune_yf = y1 << 4;
+            tune_tau = 0;
+            set_DC(tune_d0);
+            tune_state = TUNE_RETURN;
+            break;
+        default: /// <li> Done if the crossing was found </ul>
+            tune_state = tune_tau ? TUNE_DONE : TUNE_FAIL;
+    }
+    if (tune_state < TUNE_SETTLE) /// * Close the loop again, #ctrl.pidi was kept during the identification
+    {
+        ctrl.pidt = (int32_t) tune_d0 << 16;
+        set_DC(tune_d0);
+    }
+}
+
+/**@brief This function calculates the gains of the identified loop with the symmetric optimum, for the
+* plant gain K = #tune_dy / #tune_step and the time constant #tune_tau. #pid adds kp x e to the duty cycle on every cycle, so
+* kp is an integral gain: kp = 1 / (2 K tau) and ki = kp / (4 tau).
+* @param gain_kp kp in Q8.24
+* @param gain_ki ki in Q8.24
+* @return false if there is no identification done
+*/
+bool tune_gains(int32_t* gain_kp, int32_t* gain_ki)
+{
+    uint32_t    q;
+    
+    if (tune_state != TUNE_DONE) return false;
+    q = ( (uint32_t) tune_step << 23 ) / ( (uint32_t) tune_dy * tune_tau ); /// * 2^24 / (2 K tau)
+    if (q > PID_MICRO_TO_Q24(CONF_GAIN_MAX)) q = PID_MICRO_TO_Q24(CONF_GAIN_MAX); /// * Limited to what CONFigure accepts
+    *gain_kp = (int32_t) q;
+    *gain_ki = (int32_t) ( q / (4 * (uint32_t) tune_tau) );
+    return true;
+}
+
+/**@brief This function has the work of one control cycle that does not need the new samples, it is called from the Timer1 interrupt.
+* It only uses the ADC samples and the control variables, so it can also be driven by a host-side plant model.
+*/
+void control_tick() /// This function performs the folowing tasks:
+{
+#if PROFILE_ENABLE
+    uint16_t    mark;
+#endif
+    
+    PROFILE_MARK(mark);
+    ctrl.t = adc_slow_sample[ADC_SLOW_TEMP]; /// <ol> <li> Take the last temperature from #adc_slow_sample and store it in #ctrl.t
+    ADC_start_sequence(); /// <li> Start the next ADC sequence by calling #ADC_start_sequence(), it runs on the ADC and Timer2 interrupts and calls #control_sample when the voltage and current are converted
+    PROFILE_RECORD(PROF_ADC, mark);
+    
+    calculate_avg(); /// <li> Call the #calculate_avg() function, with the samples of the last sequence
+    PROFILE_RECORD(PROF_AVG, mark);
+    
+    timing(); /// <li> Call the #timing() function
+    relay_tick(); /// <li> Run the relay steps by calling the #relay_tick() function
+    if (telem_enabled) telemetry_sample(); /// <li> If the binary telemetry is enabled, call the #telemetry_sample() function </ol>
+    PROFILE_RECORD(PROF_TIMING, mark);
+}
+
+/**@brief This function runs the control law on new samples, it is called from #ADC_conversion_done as soon as
+* the fast channels of the sequence are converted. The duty cycle is updated some 30us after the Timer1 tick
+* instead of one whole control period later, when #control_tick would see the samples.
+*/
+void control_sample() /// This function performs the folowing tasks:
+{
+#if PROFILE_ENABLE
+    uint16_t    mark;
+#endif
+    
+    PROFILE_MARK(mark);
+    ctrl.v = adc_sample[ADC_SLOT_V]; /// <ol> <li> Take the voltage from #adc_sample and store it in #ctrl.v
+    ctrl.i = (uint16_t) (abs ( 2048 - (int)adc_sample[ADC_SLOT_I] ) ); /// <li> Take the current, substract the 2.5V bias and store the absolute value in #ctrl.i
+    if (ctrl.conv) /// <li> If the converter is running, accumulate #ctrl.i in #coul_acum for the coulomb counter
+    {
+        coul_acum[ctrl.dmode] += ctrl.i;
+        coul_ticks[ctrl.dmode]++;
+    }
+    if (ctrl.conv) protection_tick(); /// <li> Check the protection limits by calling the #protection_tick() function
+    if (!ctrl.conv) ctrl.pidi = 0;
+    else if (tune_state >= TUNE_SETTLE) tune_tick(); /// <li> Call the #tune_tick() function during an identification,
+    else control_loop(); /// or the #control_loop() function </ol>
+    PROFILE_RECORD(PROF_CONTROL, mark);
+}
+
+/**@brief This function calls the PI control loop for current or voltage depending on the value of the #ctrl.cmode variable.
+*/
+void control_loop()
+{   
+    ctrl.cv_vf = (uint16_t) ( ctrl.cv_vf + ( ( ( (int32_t) ctrl.v << 4 ) - ctrl.cv_vf ) >> CV_FILT_SHIFT ) ); /// Filter #ctrl.v in #ctrl.cv_vf and check the change to CV mode with #cc_cv_mode
+    cc_cv_mode();
+    if(!ctrl.cmode) /// If #ctrl.cmode is cleared then
+    {
+        set_DC(pid(ctrl.v, ctrl.v_ref));/// * The #pid() function is called with @p feedback = #ctrl.v and @p setpoint = #vref
+    }else /// Else,
+    {
+        set_DC(pid(ctrl.i, ctrl.i_ref)); /// * The #pid() function is called with @p feedback = #ctrl.i and @p setpoint = #iref
+    }
+}
+
+/**@brief This function defines the PI controller in fixed point
+*  @param   feedback average of measured values for the control variable
+*  @param   setpoint desire controlled output for the variable
+*  @return  duty cycle to be loaded with #set_DC(), between #DC_MIN and #DC_MAX
+*
+*  Same difference equation as the former float version. #ctrl.kp and #ctrl.ki are Q8.24 because they are
+*  in the order of 1E-3, #ctrl.kd is Q16.16 and #ctrl.pidi, #ctrl.pidt are Q16.16 duty counts.
+*  The PSMC only takes 9 bits, so the first #DC_DITHER_BITS of the fraction of #ctrl.pidt are accumulated
+*  in #ctrl.dc_dither and one count is added when they carry. The average duty cycle over 16 control
+*  cycles then has 13 bits and the converter filters the one count ripple.
+*/
+uint16_t pid(uint16_t feedback, uint16_t setpoint)
+{  
+    int16_t     e = (int16_t) setpoint - (int16_t) feedback;
+    uint16_t    duty;
+    
+    ctrl.pidt += ctrl.kd * (int32_t) (e - ctrl.er); /// * Calculate #diferential component of compensator
+    
+    if(e > ERR_MAX) e = ERR_MAX; /// * Make sure error is never above #ERR_MAX
+    if(e < ERR_MIN) e = ERR_MIN; /// * Make sure error is never below #ERR_MIN
+    ctrl.er = e; /// * Store the clamped error in @p er for the next cycle
+    
+	ctrl.pidi += PID_Q24_TO_Q16(ctrl.ki * (int32_t) ctrl.er); /// * Calculate #integral component of compensator
+    if (ctrl.pidi > PID_I_LIMIT) ctrl.pidi = PID_I_LIMIT;
+    else if (ctrl.pidi < -PID_I_LIMIT) ctrl.pidi = -PID_I_LIMIT;
+    ctrl.pidt += PID_Q24_TO_Q16(ctrl.kp * (int32_t) ctrl.er) + ctrl.pidi; /// * Calculate #proportional component of compensator
+    
+    ctrl.ss_limit += (int32_t) ff_slew << 6; /// * Raise the soft start ceiling #ctrl.ss_limit by #ff_slew, one second is about 2^10 cycles
+    if (ctrl.ss_limit > PID_Q16(DC_MAX)) ctrl.ss_limit = PID_Q16(DC_MAX);
+    if (ctrl.pidt >= ctrl.ss_limit) /// * Limit #ctrl.pidt and stop #ctrl.pidi from pushing it further, so the integral does not wind up
+    {
+        ctrl.pidt = ctrl.ss_limit;
+        if (ctrl.pidi > 0) ctrl.pidi = 0;
+    }
+    else if (ctrl.pidt <= PID_Q16(DC_MIN))
+    {
+        ctrl.pidt = PID_Q16(DC_MIN);
+        if (ctrl.pidi < 0) ctrl.pidi = 0;
+    }
+    duty = (uint16_t) (ctrl.pidt >> 16); /// * Take the integer part of #ctrl.pidt and add the carry of the dither, so the
+    ctrl.dc_dither += (uint8_t) (ctrl.pidt >> (16 - DC_DITHER_BITS)) & DC_DITHER_MASK; /// first #DC_DITHER_BITS of the fraction are kept on average
+    if (ctrl.dc_dither > DC_DITHER_MASK)
+    {
+        ctrl.dc_dither &= DC_DITHER_MASK;
+        duty++;
+    }
+    return duty;
+}
+/**@brief This function loads the duty cycle where the converter should settle, so #pid starts near it.
+* It is called by #relay_tick when the converter starts, so #ctrl.v is the voltage of the connected cell.
+* <ol> <li> The voltage at the converter is the cell voltage plus the drop in #ff_res at #ctrl.i_ref, or minus
+* it when discharging
+* <li> Charging is a buck from the bus, D = V / #ff_bus. Discharging is a boost to the bus, D = 1 - V / #ff_bus
+* <li> #FF_MARGIN is taken off, so an error in #ff_bus does not overshoot the current, and the result is
+* limited from #DC_MIN to #DC_MAX. Without #ff_bus the start is at #DC_MIN as before
+* <li> #ctrl.pidt and the soft start ceiling #ctrl.ss_limit are loaded with it, #pid raises the ceiling by #ff_slew </ol>
+*/
+void feedforward_start()
+{
+    uint16_t    vop = cal_to_units(CAL_V, ctrl.v);
+    uint16_t    drop = (uint16_t) ( ( (uint32_t) cal_to_units(CAL_I, ctrl.i_ref) * ff_res + 500 ) / 1000 );
+    int32_t     duty = DC_MIN;
+    
+    if (ff_bus)
+    {
+        if (ctrl.dmode) vop = (vop > drop) ? vop - drop : 0;
+        else vop += drop;
+        duty = (int32_t) ( ( (uint32_t) vop * DC_PERIOD + (ff_bus >> 1) ) / ff_bus );
+        if (ctrl.dmode) duty = DC_PERIOD - duty;
+        duty -= FF_MARGIN;
+        if (duty < DC_MIN) duty = DC_MIN;
+        if (duty > DC_MAX) duty = DC_MAX;
+    }
+    ff_duty = (uint16_t) duty;
+    ctrl.pidt = duty << 16;
+    ctrl.ss_limit = ctrl.pidt;
+    ctrl.pidi = 0;
+    ctrl.dc_dither = 0;
+    set_DC(ff_duty);
+}
+
+/**@brief This function sets the desired duty cycle
+*  @param   dc duty cycle, 9-bit
+*/
+void set_DC(uint16_t dc)
+{
+/// This function can set the duty cycle from 0x0 to 0x1FF
+    PSMC1DCL = dc & 0x00FF; /// * Lower 8 bits of #dc are stored in @p PSMC1DCL
+    PSMC1DCH = (dc >> 8) & 0x01; /// * Higher 1 bit of #dc are stored in @p PSMC1DCH
+    PSMC1CONbits.PSMC1LD = 1; /// * Set the load register. This will load all the setting as once*/
+}
+
+/**@brief This function changes from CC to CV mode when charging, it is called from #control_loop on every sample.
+* The filtered voltage #ctrl.cv_vf is compared with #ctrl.v_ref, so the cell does not go over the CV setpoint.
+* The change is bumpless: #ctrl.pidt is kept and the error of the voltage loop is loaded in #ctrl.er, so the
+* differential term does not jump.
+*/
+void cc_cv_mode()
+{
+    int16_t     e;
+    
+/// If the system is charging in CC mode and #ctrl.cv_vf is above the CV setpoint #ctrl.v_ref, then:
+    if( ctrl.cmode && !ctrl.dmode && ctrl.v_ref && ( ctrl.cv_vf > (ctrl.v_ref << 4) ) )
+    {        
+        e = (int16_t) ctrl.v_ref - (int16_t) ctrl.v;
+        if (e < ERR_MIN) e = ERR_MIN;
+        ctrl.er = e;         /// <ol> <li> The error of the voltage loop is stored in #ctrl.er
+        ctrl.pidi = 0;       /// <li> The integral acummulator is cleared, #ctrl.pidt keeps the duty cycle
+        ctrl.cmode = 0;      /// <li> The system is set in CV mode by clearing the #ctrl.cmode variable
+        set_gains();    /// <li> The gains are set to #CV_kp, #CV_ki and #CV_kd by calling #set_gains </ol>
+    }    
+}
+
+/**@brief This function takes care of scaling the average values to correspond with their real values.
+*/
+void scaling() /// This function performs the folowing tasks:
+{
+    uint16_t    out[FILT_CHANNELS];
+    bool        gie = GIE;
+    
+    GIE = 0; /// <ol><li> Copy #filt_out with the interrupts disabled, so both channels come from the same output
+    memcpy(out, filt_out, sizeof(out));
+    GIE = gie;
+    log_data.current = cal_to_units_fine(CAL_I, out[CAL_I]); /// <li> Scale the current to mA with the calibration of #CAL_I, by calling #cal_to_units_fine
+    log_data.voltage = cal_to_units_fine(CAL_V, out[CAL_V]); /// <li> Scale the voltage to mV with the calibration of #CAL_V
+    log_data.temperature = cal_to_units_fine(CAL_T, out[CAL_T]); /// <li> Scale the temperature with the calibration of #CAL_T </ol>
+}
+
+/**@brief This function integrates the current samples accumulated by #control_sample into the totals of #coulomb.
+* The calibration of #CAL_I is applied to the sum, and every remainder is kept for the next call, so
+* the totals do not drift however long the test is. The energy uses the one-second-average voltage.
+* The totals are only written here, in the main loop, so the SCPI queries read them whole.
+*/
+void coulomb_update()
+{
+    uint8_t         k;
+    bool            gie;
+    uint32_t        counts;
+    uint16_t        ticks;
+    uint32_t        low;
+    int32_t         sum;
+    uint32_t        charge;
+    coulomb_type*   c;
+    
+    for (k = COUL_CHARGE; k <= COUL_DISCHARGE; k++)
+    {
+        gie = GIE;
+        GIE = 0; /// * Take and clear #coul_acum and #coul_ticks with the interrupts disabled
+        counts = coul_acum[k];
+        ticks = coul_ticks[k];
+        coul_acum[k] = 0;
+        coul_ticks[k] = 0;
+        GIE = gie;
+        if (!ticks) continue;
+        c = &coulomb[k];
+        low = (counts & 0xFFF) * cal[CAL_I].gain + c->cal_rem; /// * Apply the gain in two parts, so the product fits in 32 bits
+        c->cal_rem = (uint16_t) (low & 0xFFF);
+        sum = (int32_t) ( (counts >> CAL_SHIFT) * cal[CAL_I].gain + (low >> CAL_SHIFT) );
+        sum += (int32_t) cal[CAL_I].offset * ticks; /// * Add the offset once per sample, the sum is in mA ticks
+        if (sum < 0) sum = 0;
+        sum += c->tick_rem; /// * Divide by #COUL_TICKS to get mAs
+        charge = (uint32_t) sum / COUL_TICKS;
+        c->tick_rem = (uint16_t) ( (uint32_t) sum % COUL_TICKS );
+        c->charge += charge;
+        low = charge * log_data.voltage + c->energy_rem; /// * Multiply by the voltage in mV to get the energy in uWs, and then mWs
+        c->energy += low / 1000;
+        c->energy_rem = (uint16_t) (low % 1000);
+    }
+    log_data.capacity = (uint16_t) (coulomb[ctrl.dmode].charge / 3600); /// The capacity is the charge of the present mode in mAh
+}
+
+/**@brief This function clears the coulomb counter, it is called when the converter is started
+*/
+void coulomb_reset()
+{
+    bool        gie = GIE;
+    
+    GIE = 0;
+    memset(coul_acum, 0, sizeof(coul_acum));
+    memset(coul_ticks, 0, sizeof(coul_ticks));
+    GIE = gie;
+    memset(coulomb, 0, sizeof(coulomb));
+}
+
+/**@brief This function stores #log_data in the RAM log #log_blocks, it is called by #task_second every #log_decimation seconds.
+* A block keeps its first record in full and the next ones as changes: 8 bits for the voltage and the current, 4 bits for
+* the capacity and the temperature, that move slowly. A new block is started when the block is full, a change does not
+* fit, #second did not advance by #log_decimation or the decimation was changed. When all the
+* blocks are used the oldest one is overwritten and its records not read are counted in #log_lost.
+*/
+void log_record()
+{
+    log_block_type*     b = &log_blocks[log_head];
+    int32_t             d[LOG_FIELDS];
+    int32_t             limit;
+    bool                fit;
+    uint8_t             k;
+    
+    d[0] = (int32_t) log_data.voltage - log_last.voltage;
+    d[1] = (int32_t) log_data.current - log_last.current;
+    d[2] = (int32_t) log_data.capacity - log_last.capacity;
+    d[3] = (int32_t) log_data.temperature - log_last.temperature;
+    fit = log_used && b->count <= LOG_DELTAS && b->decimation == log_decimation && second == (uint16_t) (log_second + log_decimation);
+    for (k = 0; k < LOG_FIELDS; k++)
+    {
+        limit = (k < 2) ? INT8_MAX : LOG_SLOW_MAX;
+        if (d[k] > limit || d[k] < -limit - 1) fit = 0;
+    }
+    if (fit) /// <ol> <li> If the record fits in the present block, store the changes
+    {
+        b->delta[b->count - 1].voltage = (int8_t) d[0];
+        b->delta[b->count - 1].current = (int8_t) d[1];
+        b->delta[b->count - 1].slow = (uint8_t) ( (d[2] << 4) | (d[3] & 0x0F) );
+        b->count++;
+    }else /// <li> Else, start a new block with the full record
+    {
+        if (log_used) log_head = (log_head + 1) & LOG_MASK;
+        b = &log_blocks[log_head];
+        b->sequence = log_sequence;
+        b->second = second;
+        b->decimation = log_decimation;
+        b->count = 1;
+        b->first = log_data;
+        if (log_used < LOG_BLOCKS) log_used++;
+        else if ( (int16_t) (log_blocks[(log_head + 1) & LOG_MASK].sequence - log_read) > 0 ) /// If a block was overwritten, move #log_read to the oldest record left
+        {
+            log_lost += log_blocks[(log_head + 1) & LOG_MASK].sequence - log_read;
+            log_read = log_blocks[(log_head + 1) & LOG_MASK].sequence;
+        }
+    }
+    log_last = log_data;
+    log_second = second;
+    log_sequence++;
+    if ( (uint16_t) (log_sequence - log_read) > log_high ) log_high = log_sequence - log_read; /// <li> Update the high-water mark #log_high </ol>
+}
+
+/**@brief This function empties the RAM log and clears its counters
+*/
+void log_clear()
+{
+    log_used = 0;
+    log_head = 0;
+    log_sequence = 0;
+    log_read = 0;
+    log_high = 0;
+    log_lost = 0;
+}
+
+/**@brief This function starts a new conversion sequence over the channels of #adc_sequence.
+* The first channel is already selected and acquired since the end of the previous sequence, so the
+* conversion starts right away. The rest of the sequence is run by #ADC_conversion_done and #ADC_acquisition_done.
+*/
+void ADC_start_sequence()
+{
+    uint8_t     n;
+    uint8_t     k;
+    
+    if (adc_slot < adc_seq_len) /// If the previous sequence is still running
+    {
+        adc_overrun++; /// * Count the overrun and let it finish, #adc_sample keeps the last values
+        return;
+    }
+    adc_seq_len = ADC_SEQ_FAST; /// Else,
+    adc_slow_pending = ADC_SLOW_CHANNELS;
+    for (k = 0; k < ADC_SLOW_CHANNELS; k++) /// * Count down the ticks of every slow channel
+    {
+        if (adc_slow_countdown[k]) adc_slow_countdown[k]--;
+    }
+    k = adc_slow_next;
+    for (n = 0; n < ADC_SLOW_CHANNELS; n++) /// * Add the first slow channel that is due, starting after the last one converted
+    {
+        if (adc_slow_period[k] && !adc_slow_countdown[k])
+        {
+            adc_slow_countdown[k] = adc_slow_period[k];
+            adc_slow_pending = k;
+            adc_sequence[ADC_SLOT_SLOW] = adc_slow_channel[k];
+            adc_seq_len = ADC_SEQ_MAX;
+            adc_slow_next = (k + 1 < ADC_SLOW_CHANNELS) ? k + 1 : 0;
+            break;
+        }
+        if (++k == ADC_SLOW_CHANNELS) k = 0;
+    }
+    adc_slot = 0; /// * Start from the first slot
+    GO_nDONE = 1;
+}
+
+/**@brief This function is called from the ISR when the ADC finishes a conversion.
+* It stores the result and selects the next channel of #adc_sequence, then Timer2 gives the
+* acquisition time before the next conversion, so no time is wasted waiting for the ADC.
+*/
+void ADC_conversion_done()
+{
+    uint16_t    result = (uint16_t)((ADRESL & 0xFF)|((ADRESH << 8) & 0xF00));
+    
+    if (adc_slot == ADC_SLOT_SLOW) adc_slow_sample[adc_slow_pending] = result; /// * Store the result in #adc_slow_sample if it is the slow channel,
+    else adc_sample[adc_slot] = result; /// or in #adc_sample
+    adc_slot++;
+    if (adc_slot == ADC_SEQ_FAST) control_sample(); /// * Run the control law by calling #control_sample when the fast channels are done
+    if (adc_slot < adc_seq_len) /// * If there are channels left in the sequence
+    {
+        ADCON0bits.CHS = adc_sequence[adc_slot]; /// <ol> <li> Select the next channel
+        TMR2 = 0;
+        TMR2ON = 1; /// <li> Start the acquisition timer </ol>
+    }
+    else /// * Else,
+    {
+        ADCON0bits.CHS = adc_sequence[0]; /// <ol> <li> Select the first channel, it will be acquired until the next Timer1 tick </ol>
+    }
+}
+
+/**@brief This function checks the temperature on every filter output. Above #t_derate the current setpoint
+* is reduced in proportion, down to zero at #t_prot, and at #t_prot the converter is stopped. A limit set to zero is disabled.
+*/
+void temperature_check()
+{
+    uint16_t    current = const_cur;
+    uint16_t    ref;
+    bool        gie;
+    
+    if (!ctrl.conv) return; /// Only when the converter is running
+    if (t_prot && log_data.temperature >= t_prot) /// * Stop it if #t_prot is reached, and latch #FAULT_OTP
+    {
+        prot_fault = FAULT_OTP;
+        end_cause = END_PROT;
+        STOP_CONVERTER();
+        return;
+    }
+    if (t_derate && t_prot > t_derate && log_data.temperature > t_derate) /// * Above #t_derate scale #const_cur by the distance to #t_prot
+    {
+        current = (uint16_t) ( (uint32_t) const_cur * (t_prot - log_data.temperature) / (t_prot - t_derate) );
+    }
+    ref = cal_from_units(CAL_I, current);
+    gie = GIE;
+    GIE = 0; /// * Update #ctrl.i_ref with the interrupts disabled, it is read by the control loop
+    ctrl.i_ref = ref;
+    GIE = gie;
+}
+
+/**@brief This function is called from the ISR when Timer2 matches #ADC_ACQ_COUNT, the acquisition time
+* of the selected channel is over so its conversion is started.
+*/
+void ADC_acquisition_done()
+{
+    TMR2ON = 0;
+    GO_nDONE = 1;
+}
+
+/**@brief This function reads Timer1 as a time stamp for the profiler, in 0.125us ticks.
+* The high byte is read twice, in case the low byte overflows between the reads.
+* @return Timer1 16-bit value
+*/
+uint16_t profile_now()
+{
+    uint8_t     high;
+    uint8_t     low;
+    
+    do
+    {
+        high = TMR1H;
+        low = TMR1L;
+    } while (high != TMR1H);
+    return (uint16_t) ( ( (uint16_t) high << 8 ) | low );
+}
+
+/**@brief This function adds one measurement to the statistics of a stage in #profile
+* @param stage index of the stage, PROF_*
+* @param elapsed duration in Timer1 ticks
+*/
+void profile_add(uint8_t stage, uint16_t elapsed)
+{
+    profile_type*   p = &profile[stage];
+    uint8_t         bin = 0;
+    uint16_t        limit = PROF_BIN_FIRST;
+    
+    if (p->n == UINT16_MAX) return; /// * Stop when the sample counter is full, so the mean stays valid
+    if (elapsed < p->min) p->min = elapsed; /// * Update the minimum and maximum
+    if (elapsed > p->max) p->max = elapsed;
+    p->sum += elapsed; /// * Accumulate for the mean
+    p->n++;
+    while (bin < PROF_BINS - 1 && elapsed >= limit) /// * Find the histogram bin, every bin is 4 times as wide as the previous one
+    {
+        bin++;
+        limit <<= PROF_BIN_SHIFT;
+    }
+    p->hist[bin]++;
+}
+
+/**@brief This function records a stage that started at @p start by calling #profile_add
+* @param stage index of the stage, PROF_*
+* @param start time stamp from #profile_now at the beginning of the stage
+* @return time stamp after the bookkeeping, so it can be used as the start of the next stage
+*/
+uint16_t profile_record(uint8_t stage, uint16_t start)
+{
+    profile_add(stage, profile_now() - start);
+    return profile_now();
+}
+
+/**@brief This function sends one field of DIAG:TIM?, a comma and @p value, after waiting until it fits in
+* #uart_tx_buffer with the newline that may follow it
+*/
+void profile_send_field(int32_t value)
+{
+    UART_wait_tx(PROF_FIELD_MAX);
+    UART_send_char(',');
+    UART_send_number(value);
+}
+
+/**@brief This function clears the statistics of every stage in #profile
+*/
+void profile_reset()
+{
+    uint8_t     k;
+    bool        gie = GIE;
+    
+    GIE = 0; /// * Disable the interrupts, #profile is written by the ISR
+    memset(profile, 0, sizeof(profile));
+    for (k = 0; k < PROF_STAGES; k++) profile[k].min = UINT16_MAX;
+    GIE = gie;
+}
+
+/**@brief This function reads #ctrl.task_ticks, it is written by the ISR
+* @return control cycles since the reset
+*/
+uint16_t task_now()
+{
+    uint16_t    now;
+    bool        gie = GIE;
+    
+    GIE = 0;
+    now = ctrl.task_ticks;
+    GIE = gie;
+    return now;
+}
+
+/**@brief This function is the cooperative scheduler of the main loop, it runs one released task of #tasks.
+* The table is in order of priority, so after every task the search starts again from the first one.
+* A task started more than its deadline after the release is counted in #task_missed, and if a whole
+* period was lost it is released again one period from now, instead of running once for every lost period.
+*/
+void task_run()
+{
+    uint16_t    now = task_now();
+    uint8_t     k;
+    
+    for (k = 0; k < TASKS; k++)
+    {
+        if ( (int16_t) (now - task_release[k]) < 0 ) continue; /// * Skip the tasks not released yet
+        if ( (uint16_t) (now - task_release[k]) > tasks[k].deadline ) task_missed[k]++; /// * Count a late start
+        task_release[k] += tasks[k].period; /// * Set the next release
+        if ( (int16_t) (now - task_release[k]) >= 0 ) task_release[k] = now + tasks[k].period;
+        tasks[k].run(); /// * Run the first released task and return
+        return;
+    }
+}
+
+/**@brief Task: if the protection turned off the converter, finish the stop with #STOP_CONVERTER
+*/
+void task_protection()
+{
+    if (!prot_pending) return;
+    prot_pending = 0;
+    STOP_CONVERTER();
+}
+
+/**@brief Task: when the filter has a new output, scale it with #scaling and check the temperature with #temperature_check
+*/
+void task_measure()
+{
+    if (!filt_ready) return;
+    filt_ready = 0;
+    scaling();
+    temperature_check();
+}
+
+/**@brief Task: once per second, integrate the charge with #coulomb_update, log it with #log_record, check the end limits with #check_limits
+* and update the profile and the scheduled session with #profile_update and #scheduler_update
+*/
+void task_second()
+{
+    coulomb_update();
+    if (ctrl.conv && log_enabled && !--log_countdown) /// Store a record with #log_record every #log_decimation seconds while the converter runs
+    {
+        log_countdown = log_decimation;
+        log_record();
+    }
+    check_limits();
+    profile_update();
+    scheduler_update();
+}
+
+/**@brief Task: assemble the received bytes with #UART_read_until, when a line is complete, execute it with
+* #command_interpreter and send the status byte. If the telemetry was on when the line arrived, the status is
+* sent in a frame by #telemetry_status, so a bare 0x00 or 0x01 never lands between the frames
+*/
+void task_command()
+{
+    if (UART_read_until(uart_line, ASCII_NEWLINE))
+    {
+        if (telem_enabled) telemetry_status(command_interpreter(uart_line)); /// #telem_enabled is read before the line is executed
+        else UART_send_byte(command_interpreter(uart_line));
+    }
+}
+
+/**@brief Task: if there is a telemetry snapshot, send it with #telemetry_send
+*/
+void task_telemetry()
+{
+    if (telem_pending) telemetry_send();
+}
+
+/**@brief This function control the timing
+*/
+void timing()
+{
+    ctrl.task_ticks++; /// Increase #ctrl.task_ticks, the time base of #task_run
+    if(!ctrl.count) /// If #ctrl.count is other than zero, then
+    {
+        ctrl.count = COUNTER; /// * Make #ctrl.count equal to #COUNTER
+        second++; /// * always increase second, no more minutes
+    }else /// Else,
+    {
+        ctrl.count--; /// * Decrease it
+    }
+}
+/**@brief This function filters the samples of every channel in #filt_source and decimates them to one output
+* every 2^#filt_shift samples. On every sample it only adds it to #filt_acum, the division and the IIR run once
+* per window. The window is a power of two, so only shifts are needed and the extra resolution of the
+* oversampling is kept in #filt_out.
+*/
+void calculate_avg()
+{
+    uint8_t     k;
+    uint16_t    mean;
+    
+    for (k = 0; k < FILT_CHANNELS; k++) filt_acum[k] += *filt_source[k]; /// Accumulate the sample of every channel
+    if (--filt_count) return; /// When the window is complete:
+    filt_count = (uint16_t) 1 << filt_shift;
+    for (k = 0; k < FILT_CHANNELS; k++)
+    {
+        mean = (uint16_t) ( ( filt_acum[k] + ( 1L << (filt_shift - FILT_FRAC_BITS - 1) ) ) >> (filt_shift - FILT_FRAC_BITS) ); /// * Divide the sum by the window, keeping #FILT_FRAC_BITS, and start the next one
+        filt_acum[k] = 0;
+        if (filt_type == FILT_AVERAGE || filt_seed) filt_out[k] = mean; /// * #FILT_AVERAGE outputs the average, #FILT_IIR starts from the first one
+        else filt_out[k] = (uint16_t) ( filt_out[k] + ( ( ( (int32_t) mean - filt_out[k] ) * FILT_IIR_GAIN + 128 ) >> 8 ) ); /// * and then moves #FILT_IIR_GAIN / 256 of the way to every average
+    }
+    filt_seed = 0;
+    vavg = (filt_out[CAL_V] + 8) >> FILT_FRAC_BITS; /// * Round the outputs to ADC counts in #vavg, #iavg and #tavg
+    iavg = (filt_out[CAL_I] + 8) >> FILT_FRAC_BITS;
+    tavg = (filt_out[CAL_T] + 8) >> FILT_FRAC_BITS;
+    filt_ready = 1; /// * Set #filt_ready for the main loop
+}
+
+/**@brief This function changes the filter and starts it again
+* @param type FILT_*
+* @param shift the window is 2^shift samples, from #FILT_SHIFT_MIN to #FILT_SHIFT_MAX
+*/
+void filter_set(uint8_t type, uint8_t shift)
+{
+    bool        gie = GIE;
+    
+    GIE = 0; /// * Disable the interrupts, the filter is run by the ISR
+    filt_type = type;
+    filt_shift = shift;
+    filt_count = (uint16_t) 1 << shift;
+    memset(filt_acum, 0, sizeof(filt_acum));
+    filt_seed = 1;
+    GIE = gie;
+}
+
+/**@brief This function converts ADC counts to mV, mA or the temperature unit with the calibration of a channel.
+* Only integer multiply and shift: value = counts x gain / 4096 + offset.
+* @param channel CAL_V, CAL_I or CAL_T
+* @param counts ADC counts
+* @return calibrated value, limited from 0 to 65535
+*/
+uint16_t cal_to_units(uint8_t channel, uint16_t counts)
+{
+    return cal_to_units_fine(channel, counts << FILT_FRAC_BITS);
+}
+
+/**@brief This function is #cal_to_units for a value in 1/16 ADC counts, like #filt_out
+* @param channel CAL_V, CAL_I or CAL_T
+* @param value ADC counts with #FILT_FRAC_BITS fractional bits
+* @return calibrated value, limited from 0 to 65535
+*/
+uint16_t cal_to_units_fine(uint8_t channel, uint16_t value)
+{
+    int32_t     units = (int32_t) ( ( (uint32_t) value * cal[channel].gain + ( (uint32_t) CAL_ROUND << FILT_FRAC_BITS ) ) >> (CAL_SHIFT + FILT_FRAC_BITS) ) + cal[channel].offset;
+    
+    if (units < 0) return 0;
+    if (units > UINT16_MAX) return UINT16_MAX;
+    return (uint16_t) units;
+}
+
+/**@brief This function converts a value in mV, mA or the temperature unit to ADC counts, it is the inverse of #cal_to_units
+* @param channel CAL_V, CAL_I or CAL_T
+* @param value calibrated value
+* @return ADC counts, limited from 0 to 4095
+*/
+uint16_t cal_from_units(uint8_t channel, uint16_t value)
+{
+    int32_t     counts = (int32_t) value - cal[channel].offset;
+    
+    if (counts <= 0) return 0;
+    counts = ( (counts << CAL_SHIFT) + (cal[channel].gain >> 1) ) / cal[channel].gain;
+    if (counts > ADC_MAX) return ADC_MAX;
+    return (uint16_t) counts;
+}
+
+/**@brief This function sets the nominal calibration of every channel
+*/
+void cal_reset()
+{
+    cal[CAL_V].offset = 0;
+    cal[CAL_V].gain = CAL_V_GAIN;
+    cal[CAL_I].offset = 0;
+    cal[CAL_I].gain = CAL_I_GAIN;
+    cal[CAL_T].offset = 0;
+    cal[CAL_T].gain = CAL_T_GAIN;
+}
+
+/**@brief This function sets the current setpoint #const_cur in mA and its scaled value #ctrl.i_ref
+* @param current setpoint in mA
+*/
+void set_current_ref(uint16_t current)
+{
+    const_cur = current;
+    ctrl.i_ref = cal_from_units(CAL_I, const_cur);
+}
+
+/**@brief This function sets the voltage setpoint #const_vol in mV and its scaled value #ctrl.v_ref
+* @param voltage setpoint in mV
+*/
+void set_voltage_ref(uint16_t voltage)
+{
+    const_vol = voltage;
+    ctrl.v_ref = cal_from_units(CAL_V, const_vol);
+}
+
+/**@brief This function reads one profile step from the data EEPROM
+* @param index position of the step, from 0 to #PROFILE_STEPS - 1
+* @param step where the step is stored
+*/
+void profile_read_step(uint8_t index, profile_step_type* step)
+{
+    uint8_t     address = PROFILE_EE_ADDR + index * PROFILE_STEP_SIZE;
+    
+    step->op = eeprom_read(address);
+    step->arg1 = (uint16_t) ( eeprom_read(address + 1) | ( (uint16_t) eeprom_read(address + 2) << 8 ) );
+    step->arg2 = (uint16_t) ( eeprom_read(address + 3) | ( (uint16_t) eeprom_read(address + 4) << 8 ) );
+}
+
+/**@brief This function writes one profile step in the data EEPROM. Every byte takes a few ms, so it is only for the main loop
+* @param index position of the step, from 0 to #PROFILE_STEPS - 1
+* @param step step to be stored
+*/
+void profile_write_step(uint8_t index, profile_step_type* step)
+{
+    uint8_t     address = PROFILE_EE_ADDR + index * PROFILE_STEP_SIZE;
+    
+    eeprom_write(address, step->op);
+    eeprom_write(address + 1, (uint8_t) step->arg1);
+    eeprom_write(address + 2, (uint8_t) (step->arg1 >> 8));
+    eeprom_write(address + 3, (uint8_t) step->arg2);
+    eeprom_write(address + 4, (uint8_t) (step->arg2 >> 8));
+}
+
+/**@brief This function starts the profile stored in the data EEPROM from its first step
+* @return false if the profile stopped with an error before its first charge, discharge or rest
+*/
+bool profile_start()
+{
+    prof_saved[0] = v_endd; /// * Save the limits that the steps change in #prof_saved, #profile_stop restores them
+    prof_saved[1] = i_endc;
+    prof_saved[2] = v_endc;
+    memset(prof_loop, 0, sizeof(prof_loop)); /// * Clear the loop counters
+    prof_pc = 0;
+    prof_active = 1;
+    return profile_execute(); /// * Execute the first step with #profile_execute
+}
+
+/**@brief This function stops the profile, the converter is stopped by the caller
+*/
+void profile_stop()
+{
+    if (prof_active) /// * If it was running, restore the limits saved by #profile_start
+    {
+        v_endd = prof_saved[0];
+        i_endc = prof_saved[1];
+        v_endc = prof_saved[2];
+    }
+    prof_active = 0;
+    prof_state = PROF_IDLE;
+}
+
+/**@brief This function executes the profile from #prof_pc until a step has to wait for the converter or for a rest.
+* The loop and limit steps are executed at once. The number of steps executed in one call is bounded, so a 
+* wrong profile can not hang the main loop.
+* @return false if the profile stopped with an error: a wrong step, or a mode or a start that could not be queued
+*/
+bool profile_execute()
+{
+    profile_step_type   step;
+    uint8_t             guard = PROFILE_GUARD;
+    
+    while (guard--)
+    {
+        if (prof_pc >= PROFILE_STEPS) /// * Running out of steps is the same as #PROF_OP_END
+        {
+            step.op = PROF_OP_END;
+        }
+        else
+        {
+            profile_read_step(prof_pc, &step);
+        }
+        switch (step.op)
+        {
+            case PROF_OP_END: /// * #PROF_OP_END: the profile is over
+                profile_stop();
+                end_cause = END_LIMIT;
+                return true;
+            case PROF_OP_CHARGE: /// * #PROF_OP_CHARGE: CC-CV charge at @p arg1 mA up to @p arg2 mV, until the end of charge limits
+                set_current_ref(step.arg1);
+                set_voltage_ref(step.arg2);
+                if (!set_mode(0) || !converter_settings()) /// The mode and the start must be queued, else the profile stops
+                {
+                    profile_stop();
+                    end_cause = END_ERROR;
+                    return false;
+                }
+                prof_state = PROF_CONVERTER;
+                return true;
+            case PROF_OP_DISCHARGE: /// * #PROF_OP_DISCHARGE: CC discharge at @p arg1 mA down to @p arg2 mV
+                set_current_ref(step.arg1);
+                v_endd = step.arg2;
+                if (!set_mode(1) || !converter_settings())
+                {
+                    profile_stop();
+                    end_cause = END_ERROR;
+                    return false;
+                }
+                prof_state = PROF_CONVERTER;
+                return true;
+            case PROF_OP_REST: /// * #PROF_OP_REST: keep the converter off for @p arg1 seconds
+                if (step.arg1)
+                {
+                    prof_rest = step.arg1;
+                    prof_state = PROF_REST;
+                    return true;
+                }
+                prof_pc++;
+                break;
+            case PROF_OP_LOOP: /// * #PROF_OP_LOOP: go back to step @p arg1, @p arg2 times, up to 255
+                if (step.arg2 > UINT8_MAX) /// The 8-bit counter would never reach it
+                {
+                    profile_stop();
+                    end_cause = END_ERROR;
+                    return false;
+                }
+                if (prof_loop[prof_pc] < step.arg2)
+                {
+                    prof_loop[prof_pc]++;
+                    prof_pc = (uint8_t) step.arg1;
+                }
+                else
+                {
+                    prof_loop[prof_pc] = 0; /// Clear the counter, so an outer loop can run it again
+                    prof_pc++;
+                }
+                break;
+            case PROF_OP_ENDC: /// * #PROF_OP_ENDC: set the end of charge current to @p arg1 mA and voltage to @p arg2 mV
+                i_endc = step.arg1;
+                v_endc = step.arg2;
+                prof_pc++;
+                break;
+            default: /// * Any other code stops the profile
+                profile_stop();
+                end_cause = END_ERROR;
+                return false;
+        }
+    }
+    profile_stop(); /// If the guard runs out, the profile is wrong
+    end_cause = END_ERROR;
+    return false;
+}
+
+/**@brief This function is called once per second. It goes to the next step of the profile when the 
+* converter stops at an end limit or when a rest is over. Any other stop ends the profile.
+*/
+void profile_update()
+{
+    if (!prof_active) return;
+    if (prof_state == PROF_CONVERTER) /// If the step uses the converter
+    {
+        if (ctrl.conv || !relay_ready()) return; /// * Wait while it is running or its relays are switching
+        if (end_cause != END_LIMIT) /// * If it was not stopped by an end limit, end the profile
+        {
+            profile_stop();
+            return;
+        }
+    }
+    else if (prof_state == PROF_REST) /// If it is a rest
+    {
+        if (--prof_rest) return; /// * Wait for the time to be over
+    }
+    prof_pc++; /// Then, execute the next step
+    profile_execute();
+}
+
+/**@brief This function reads one configuration slot from the data EEPROM
+* @param slot slot index, from 0 to #CONFIG_SLOTS - 1
+* @param cfg where the slot is stored
+* @return true if the slot has the present #CONFIG_VERSION and a correct CRC
+*/
+bool config_read_slot(uint8_t slot, config_type* cfg)
+{
+    uint8_t     address = CONFIG_EE_ADDR + slot * sizeof(config_type);
+    uint8_t*    data = (uint8_t*) cfg;
+    uint8_t     k;
+    
+    for (k = 0; k < sizeof(config_type); k++) data[k] = eeprom_read(address + k); /// * Read every byte
+    if (cfg->version != CONFIG_VERSION) return false; /// * Check the version and the CRC
+    return (cfg->crc == crc16(sizeof(config_type) - sizeof(cfg->crc), data));
+}
+
+/**@brief This function finds the newest valid configuration slot. The sequence numbers are compared
+* with wrap around, so the slots can be written forever.
+* @param cfg where the newest slot is stored
+* @return index of the newest slot, or #CONFIG_SLOTS if there is no valid slot
+*/
+uint8_t config_find(config_type* cfg)
+{
+    config_type     slot_cfg;
+    uint8_t         newest = CONFIG_SLOTS;
+    uint8_t         k;
+    
+    for (k = 0; k < CONFIG_SLOTS; k++)
+    {
+        if (!config_read_slot(k, &slot_cfg)) continue;
+        if (newest == CONFIG_SLOTS || (int8_t) (slot_cfg.sequence - cfg->sequence) > 0) /// * Keep the slot if it is newer
+        {
+            newest = k;
+            *cfg = slot_cfg;
+        }
+    }
+    return newest;
+}
+
+/**@brief This function loads the gains and the calibration from the newest valid configuration slot. If there is none, 
+* the initial values are kept.
+* @return true if a configuration was loaded
+*/
+bool config_load()
+{
+    config_type     cfg;
+    
+    if (config_find(&cfg) == CONFIG_SLOTS) return false;
+    CV_kp = cfg.CV_kp; /// * Copy the gains
+    CV_ki = cfg.CV_ki;
+    CV_kd = cfg.CV_kd;
+    CC_char_kp = cfg.CC_char_kp;
+    CC_char_ki = cfg.CC_char_ki;
+    CC_disc_kp = cfg.CC_disc_kp;
+    CC_disc_ki = cfg.CC_disc_ki;
+    CC_char_disc_kd = cfg.CC_char_disc_kd;
+    memcpy(cal, cfg.cal, sizeof(cal)); /// * Copy the calibration
+    set_gains(); /// * Load them in the controller with #set_gains
+    return true;
+}
+
+/**@brief This function saves the gains and the calibration in the slot after the newest one, so the writes are spread over 
+* every slot. Only the bytes that change are written. It takes some ms per byte, so it is only for the main loop.
+*/
+void config_save()
+{
+    config_type     cfg;
+    uint8_t         slot;
+    uint8_t         sequence = 0;
+    uint8_t         address;
+    uint8_t*        data = (uint8_t*) &cfg;
+    uint8_t         k;
+    
+    slot = config_find(&cfg); /// * Find the newest slot, the next one is used
+    if (slot == CONFIG_SLOTS)
+    {
+        slot = 0;
+    }
+    else
+    {
+        sequence = cfg.sequence + 1;
+        slot = (slot + 1) % CONFIG_SLOTS;
+    }
+    cfg.version = CONFIG_VERSION; /// * Fill the block
+    cfg.sequence = sequence;
+    cfg.CV_kp = CV_kp;
+    cfg.CV_ki = CV_ki;
+    cfg.CV_kd = CV_kd;
+    cfg.CC_char_kp = CC_char_kp;
+    cfg.CC_char_ki = CC_char_ki;
+    cfg.CC_disc_kp = CC_disc_kp;
+    cfg.CC_disc_ki = CC_disc_ki;
+    cfg.CC_char_disc_kd = CC_char_disc_kd;
+    memcpy(cfg.cal, cal, sizeof(cal));
+    cfg.crc = crc16(sizeof(config_type) - sizeof(cfg.crc), data); /// * Append the CRC
+    address = CONFIG_EE_ADDR + slot * sizeof(config_type);
+    for (k = 0; k < sizeof(config_type); k++) /// * Write the bytes that are different
+    {
+        if (eeprom_read(address + k) != data[k]) eeprom_write(address + k, data[k]);
+    }
+}
+
+/**@brief This function starts a scheduled session on the cells of #sched_mask, one after the other.
+* Every cell runs the test configured with MODE, VOLT, CURR and the limits.
+* @return false if no cell is selected or the first one does not start
+*/
+bool scheduler_start()
+{
+    uint8_t     k;
+    
+    if (!sched_mask) return false;
+    for (k = 0; k < CELLS; k++) /// * Queue the selected cells and clear their results
+    {
+        cell_results[k].status = (sched_mask & (1 << k)) ? CELL_QUEUED : CELL_IDLE;
+        cell_results[k].capacity = 0;
+        cell_results[k].time = 0;
+    }
+    sched_active = 1;
+    return scheduler_next(); /// * Start the first one with #scheduler_next
+}
+
+/**@brief This function starts the test of the next queued cell, or ends the session if there is none
+* @return false if the cell did not start, then it is stopped and the session ends
+*/
+bool scheduler_next()
+{
+    uint8_t     k;
+    
+    for (k = 0; k < CELLS; k++) /// * Find the first queued cell
+    {
+        if (cell_results[k].status == CELL_QUEUED) break;
+    }
+    if (k == CELLS) /// * If there is none, the session is over
+    {
+        sched_active = 0;
+        return true;
+    }
+    cell_results[k].status = CELL_RUNNING; /// * Else, select it in #cell_count
+    cell_count = k + 1;
+    if (sched_profile) /// * Run the stored profile with #profile_start if #sched_profile is set
+    {
+        if (profile_start()) return true;
+    }
+    else if (set_mode(ctrl.dmode) && converter_settings()) /// * Else, set the mode relays again with #set_mode and start the converter
+    {
+        return true;
+    }
+    cell_results[k].status = CELL_STOPPED; /// * If it did not start, stop the cell and the session
+    end_cause = END_ERROR;
+    scheduler_stop();
+    return false;
+}
+
+/**@brief This function is called once per second. It counts the time of the running cell in its result, so
+* the time covers every stage and rest of a profile, #second is cleared at each start of the converter.
+* When the converter of a scheduled cell stops, it stores the cell results and starts the next cell.
+*/
+void scheduler_update()
+{
+    cell_result_type*   result;
+    
+    if (!sched_active) return; /// Only when a session is active
+    result = &cell_results[cell_count - 1];
+    if (result->time < UINT16_MAX) result->time++; /// * Count one more second of the running cell
+    if (ctrl.conv || prof_active || !relay_ready()) return; /// * Wait until the converter or the profile stopped and the relays are done
+    result->capacity = log_data.capacity; /// * Store the capacity of the cell
+    result->status = (end_cause == END_LIMIT) ? CELL_DONE : CELL_STOPPED; /// * It is done only if it reached an end limit
+    if (end_cause == END_USER) /// * If the user stopped it, end the session
+    {
+        scheduler_stop();
+        return;
+    }
+    scheduler_next(); /// * Else, go to the next cell
+}
+
+/**@brief This function ends the scheduled session, the cells still queued go back to idle
+*/
+void scheduler_stop()
+{
+    uint8_t     k;
+    
+    for (k = 0; k < CELLS; k++)
+    {
+        if (cell_results[k].status == CELL_QUEUED) cell_results[k].status = CELL_IDLE;
+    }
+    sched_active = 0;
+}
+
+/**@brief Function to set the configurations of the converter.
+* @return false if it was not started, a protection fault is latched or #relay_queue is full
+*/
+bool converter_settings()
+{
+    if (prot_fault) /// * Do not start while a protection fault is latched
+    {
+        end_cause = END_PROT;
+        return false;
+    }
+    if (relay_space() < RELAY_START_STEPS) return false; /// * Nor if the steps of the start do not fit in #relay_queue
+    if (tune_state >= TUNE_SETTLE) tune_state = TUNE_FAIL; /// * An identification cut by a stop is not valid
+    // POR VERIFICAR 
+    ctrl.cmode = 1; /// * Start in constant current mode by setting. #ctrl.cmode
+    set_gains(); /// * Load the CC gains of the present mode with #set_gains
+    end_cause = END_NONE; /// * Clear #end_cause
+    protection_update(); /// * Convert the protection limits with the present calibration by calling #protection_update
+    ctrl.cv_vf = ctrl.v << 4; /// * Start #ctrl.cv_vf from the last voltage sample
+    memset(prot_count, 0, sizeof(prot_count));
+    ctrl.pidi = 0; /// * The #integral component of the compensator is set to zero.*/
+    coulomb_reset(); /// * Clear the charge and energy totals with #coulomb_reset
+    log_data.capacity = 0;
+    vmax = 0; /// * Maximum averaged voltage, #vmax is set to zero.*/
+    ctrl.pidt = PID_Q16(DC_MIN);
+    set_DC(DC_MIN);  /// * The #set_DC() function is called
+    Cell_ON(); /// * The #Cell_ON() function is called
+    
+    // iref
+    // set_char
+    // timeout
+    
+    relay_push(RELAY_WAIT, RELAY_CELL_GUARD); /// * Queue the start, #relay_tick clears #second and sets #ctrl.conv after the relays
+    return relay_push(RELAY_START, 0);
+}
+
+/**@brief This function activate the UART reception interruption 
+*/
+void interrupt_enable()
+{
+    while(RCIF){
+        (void) RC1REG; /// * Clear the reception buffer by reading it, the bytes are discarded
+    }
+    RCIE = 1;           /// * Enable UART reception interrupts
+    TXIE = 0;           /// * Disable UART transmission interrupts
+    TMR1IE = 1;         //enable T1 interrupt
+    ADIF = 0;           //Clear ADC interrupt flag
+    ADIE = 1;           //enable ADC interrupt
+    TMR2IF = 0;         //Clear timer2 interrupt flag
+    TMR2IE = 1;         //enable T2 interrupt, used for the ADC acquisition time
+    PEIE = 1;           //enable peripherals interrupts
+    GIE = 1;            //enable global interrupts
+    ctrl.count = COUNTER;    /// The timing counter #ctrl.count will be initialized to zero, to start a full control loop cycle
+    profile_reset();    /// The profiler statistics are cleared by calling #profile_reset
+    TMR1IF = 0;         //Clear timer1 interrupt flag
+    TMR1ON = 1;         //turn on timer 
+}
+
+/**@brief This function send one byte of data to UART
+* @param bt character to be send
+*/
+void UART_send_char(char bt)  
+{
+    UART_send_byte((uint8_t) bt); /// * Queue @p bt by calling #UART_send_byte()
+}
+
+void UART_send_header(uint8_t start, uint8_t operation, uint8_t code)
+{
+    UART_send_byte(start);
+    UART_send_byte(operation);
+    UART_send_byte(code);
+}
+
+/**@brief This function is called from the ISR when a byte is received, it stores it in #uart_rx_buffer
+*/
+void UART_rx_isr()
+{
+    uint8_t     byte = RC1REG; /// * Read the reception register, this also clears RCIF
+    uint8_t     next = (uart_rx_head + 1) & UART_RX_MASK;
+    
+    if (next == uart_rx_tail) /// * If the buffer is full, drop the byte and count it in #uart_rx_overflow
+    {
+        uart_rx_overflow++;
+    }
+    else /// * Else, store it
+    {
+        uart_rx_buffer[uart_rx_head] = byte;
+        uart_rx_head = next;
+    }
+}
+
+/**@brief This function takes one byte from #uart_rx_buffer, it never waits for the UART
+* @param byte where the received byte is stored
+* @return true if a byte was available
+*/
+bool UART_get_byte(uint8_t* byte)
+{
+    if (uart_rx_tail == uart_rx_head) return false; /// If the buffer is empty, return false
+    *byte = uart_rx_buffer[uart_rx_tail]; /// Else, take the oldest byte
+    uart_rx_tail = (uart_rx_tail + 1) & UART_RX_MASK;
+    return true;
+}
+
+/**@brief This function assembles a line from the received bytes until a terminator is found. 
+* It takes all the bytes available and returns, so it is called from the main loop until it reports a complete line.
+* Carriage returns are ignored and lines longer than #UART_LINE_SIZE are dropped.
+* @param data buffer of #UART_LINE_SIZE characters where the line is assembled
+* @param terminator end of line character
+* @return true when a complete, null terminated line is in @p data
+*/
+bool UART_read_until(char *data, char terminator)
+{
+    uint8_t received_byte;
+
+    while (UART_get_byte(&received_byte)) { // Take every byte already received
+        if (received_byte == (uint8_t) terminator) { // Check if the received byte is the terminator
+            data[uart_line_index] = '\0'; // Null-terminate the string
+            uart_line_index = 0;
+            if (uart_line_discard) { // A line that did not fit is dropped
+                uart_line_discard = 0;
+                continue;
+            }
+            return true;
+        }
+        if (received_byte == '\r') continue;
+        if (uart_line_index < UART_LINE_SIZE - 1) { // Leave space for null terminator
+            data[uart_line_index++] = (char) received_byte; // Store the byte in the buffer
+        } else {
+            uart_line_discard = 1;
+        }
+    }
+    return false;
+}
+
+/**@brief This function queues one byte in #uart_tx_buffer, it never waits for the UART
+* @param byte byte to be send
+*/
+void UART_send_byte(uint8_t byte)  
+{
+    bool        gie = GIE; /// * Save the global interrupt state, so it can also be called from the ISR
+    uint8_t     next;
+    
+    GIE = 0; /// * Disable the interrupts while the buffer is updated
+    next = (uart_tx_head + 1) & UART_TX_MASK;
+    if (next == uart_tx_tail) /// * If the buffer is full, drop @p byte and count it in #uart_tx_overflow
+    {
+        uart_tx_overflow++;
+    }
+    else /// * Else, store @p byte and enable the transmission interrupt
+    {
+        uart_tx_buffer[uart_tx_head] = byte;
+        uart_tx_head = next;
+        TXIE = 1;
+    }
+    GIE = gie; /// * Restore the global interrupt state
+}
+
+/**@brief This function is called from the ISR when the UART transmission register is free.
+* It loads the next byte of #uart_tx_buffer and disables the interrupt when the buffer is empty.
+*/
+void UART_tx_isr()
+{
+    TX1REG = uart_tx_buffer[uart_tx_tail]; /// * Load the transmission register with the oldest byte
+    uart_tx_tail = (uart_tx_tail + 1) & UART_TX_MASK;
+    if (uart_tx_tail == uart_tx_head) TXIE = 0; /// * If there is nothing else to send, disable the interrupt
+}
+
+/**@brief This function returns the number of bytes dropped because the transmission buffer was full
+* @return #uart_tx_overflow
+*/
+uint16_t UART_get_tx_overflow()
+{
+    uint16_t    overflow;
+    bool        gie = GIE;
+    
+    GIE = 0; /// * Read it with the interrupts disabled, it is 16-bit and the ISR can also write it
+    overflow = uart_tx_overflow;
+    GIE = gie;
+    return overflow;
+}
+
+void UART_send_some_bytes(uint8_t length, uint8_t* data)
+{
+    while(length--)
+    {
+        UART_send_byte(*data++); /// * send a byte      
+    }
+}
+
+void UART_send_some_char(uint8_t length, char* data)
+{
+    while(length--)
+    {
+        UART_send_byte((uint8_t)*data++); /// * send a byte      
+    }
+}
+
+void put_data_into_structure(uint8_t length, uint8_t* data, uint8_t* structure)
+{
+    while(length--)
+    {
+        *structure++ = *data++;
+    }
+}
+
+/**@brief This function waits until @p length bytes fit in #uart_tx_buffer. It is only for the main loop, 
+* for responses longer than the buffer. It returns at once if the interrupts are disabled.
+* @param length number of bytes that will be queued
+*/
+void UART_wait_tx(uint8_t length)
+{
+    if (!GIE) return;
+    while (UART_get_tx_free() < length) CLRWDT(); /// The TX interrupt empties the buffer meanwhile
+}
+
+/** The lengths given to #UART_wait_tx must be below #UART_TX_SIZE, #UART_get_tx_free returns at most UART_TX_SIZE - 1 and the wait would never end*/
+STATIC_CHECK(uart_wait_prof, PROF_FIELD_MAX < UART_TX_SIZE);
+STATIC_CHECK(uart_wait_task, TASK_LINE_MAX < UART_TX_SIZE);
+STATIC_CHECK(uart_wait_sched, SCHED_LINE_MAX < UART_TX_SIZE);
+STATIC_CHECK(uart_wait_log, LOG_LINE_MAX < UART_TX_SIZE);
+
+/**@brief This function returns the free space in #uart_tx_buffer
+* @return number of bytes that can be queued without overflow
+*/
+uint8_t UART_get_tx_free()
+{
+    return (uint8_t) ( (uart_tx_tail - uart_tx_head - 1) & UART_TX_MASK );
+}
+
+/**@brief This function is called from the Timer1 interrupt. Every #telem_period control cycles it takes a
+* snapshot of the measurements in #telem_frame, the frame is encoded and sent by #telemetry_send from the main loop.
+*/
+void telemetry_sample()
+{
+    if (--telem_countdown) return; /// * Count down #telem_countdown, return if it is not zero
+    telem_countdown = telem_period;
+    if (telem_pending) /// * If the last frame was not sent yet, drop this one and count it in #telem_dropped
+    {
+        telem_dropped++;
+        return;
+    }
+    telem_frame.start = TELEM_START; /// * Else, fill #telem_frame and set #telem_pending
+    telem_frame.operation = TELEM_OPERATION;
+    telem_frame.code = (uint8_t) ( (ctrl.conv << 2) | (ctrl.dmode << 1) | ctrl.cmode );
+    telem_frame.sequence = telem_sequence++;
+    telem_frame.second = second;
+    telem_frame.count = ctrl.count;
+    telem_frame.v = ctrl.v;
+    telem_frame.i = ctrl.i;
+    telem_frame.log = log_data;
+    telem_pending = 1;
+}
+
+/**@brief This function calculates the CRC-16/CCITT of a block, polynomial 0x1021 and initial value 0xFFFF
+* @param length number of bytes
+* @param data pointer to the block
+* @return CRC of the block
+*/
+uint16_t crc16(uint8_t length, uint8_t* data)
+{
+    uint16_t    crc = 0xFFFF;
+    uint8_t     bit;
+    
+    while(length--)
+    {
+        crc ^= (uint16_t) (*data++) << 8;
+        for (bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t) ( (crc << 1) ^ 0x1021 ) : (uint16_t) (crc << 1);
+        }
+    }
+    return crc;
+}
+
+/**@brief This function sends the frame in #telem_frame with #frame_send. The whole frame is dropped and
+* counted in #telem_dropped if it does not fit in #uart_tx_buffer. #telem_pending is cleared after it, so the ISR
+* does not fill #telem_frame while it is encoded.
+*/
+void telemetry_send()
+{
+    if (!frame_send(sizeof(telem_frame), (uint8_t*) &telem_frame)) telem_dropped++;
+    telem_pending = 0;
+}
+
+/**@brief This function sends the status byte of a command line in a status frame, #TELEM_STATUS, with #frame_send.
+* It is counted in #telem_dropped if it does not fit in #uart_tx_buffer.
+* @param status result of #command_interpreter
+*/
+void telemetry_status(bool status)
+{
+    uint8_t     raw[TELEM_STATUS_SIZE];
+    
+    raw[0] = TELEM_START;
+    raw[1] = TELEM_STATUS;
+    raw[2] = status;
+    if (!frame_send(TELEM_STATUS_SIZE, raw)) telem_dropped++;
+}
+
+/**@brief This function COBS encodes a frame and its CRC straight into #uart_tx_buffer, between two zero bytes.
+* The leading zero ends whatever was sent before, so the host finds the start of the frame even after
+* a reply or a lost byte. Every code byte is written when the next zero is found, and #uart_tx_head is
+* only moved at the end, so the TX interrupt never sends a code byte before it is written and no copy of the frame is needed.
+* @param length bytes of @p data, less than 254 so there is only one code byte more
+* @param data frame
+* @return false if it did not fit whole in #uart_tx_buffer, then nothing is queued
+*/
+bool frame_send(uint8_t length, uint8_t* data)
+{
+    uint16_t    crc = crc16(length, data); /// * Calculate the CRC, it is sent little endian as the rest of the frame
+    uint8_t     head = uart_tx_head;
+    uint8_t     code_index;
+    uint8_t     code = 1;
+    uint8_t     byte;
+    uint8_t     k;
+    bool        gie;
+    
+    if (UART_get_tx_free() < length + 5) return false; /// * Check the space: the data, the CRC, the code byte and the delimiters
+    uart_tx_buffer[head] = 0x00; /// * Start with the delimiter
+    code_index = (head + 1) & UART_TX_MASK;
+    head = (code_index + 1) & UART_TX_MASK;
+    for (k = 0; k < length + 2; k++) /// * COBS encode it, every zero is replaced by the distance to the next one
+    {
+        if (k < length) byte = data[k];
+        else byte = (k == length) ? (uint8_t) crc : (uint8_t) (crc >> 8);
+        if (byte)
+        {
+            uart_tx_buffer[head] = byte;
+            code++;
+        }
+        else
+        {
+            uart_tx_buffer[code_index] = code;
+            code_index = head;
+            code = 1;
+        }
+        head = (head + 1) & UART_TX_MASK;
+    }
+    uart_tx_buffer[code_index] = code;
+    uart_tx_buffer[head] = 0x00; /// * And end with the delimiter
+    gie = GIE;
+    GIE = 0; /// * Queue it all at once by moving #uart_tx_head, and enable the transmission interrupt
+    uart_tx_head = (head + 1) & UART_TX_MASK;
+    TXIE = 1;
+    GIE = gie;
+    return true;
+}
+
+/**@brief This function sends a number as decimal ASCII, without @p sprintf
+* @param number value to be send
+*/
+void UART_send_number(int32_t number)
+{
+    char        digits[10];
+    uint8_t     n = 0;
+    uint32_t    u = (uint32_t) number;
+    
+    if (number < 0) /// * Send the sign if negative
+    {
+        UART_send_char('-');
+        u = 0 - u;
+    }
+    do /// * Store the digits from the least significant one
+    {
+        digits[n++] = (char) ('0' + (u % 10));
+        u /= 10;
+    } while (u);
+    while (n) UART_send_char(digits[--n]); /// * Send them in the correct order
+}
+
+/**@brief This function send a string using UART
+* @param st_pt pointer to string to be send
+*/
+void UART_send_string(char* st_pt)
+{
+    while(*st_pt) /// While there is a byte to send
+        UART_send_char(*st_pt++); /// * Queue it using #UART_send_char() and then increase the pointer possition
+}
+
+/**@brief This function queues the relay steps to select the cell of #cell_count in the switcher board.
+* The selected relay is turned on and the others off, with #RELAY_CELL_GUARD after every step
+* @return false if the steps do not fit in #relay_queue, then none is queued
+*/
+bool Cell_ON()
+{
+    uint8_t     k;
+    
+    if (relay_space() < CELLS) return false;
+    for (k = 1; k <= CELLS; k++)
+    {
+        relay_push( (RELAY_CELL1 + k - 1) | ( (k == cell_count) ? RELAY_ON : 0 ), RELAY_CELL_GUARD);
+    }
+    return true;
+}
+
+/**@brief This function deactivates all relays in the switcher board. The steps still queued are cancelled first
+*/
+void Cell_OFF()
+{
+    uint8_t     k;
+    bool        gie = GIE;
+    
+    GIE = 0; /// * Empty #relay_queue with the interrupts disabled
+    relay_tail = relay_head;
+    GIE = gie;
+    for (k = 0; k < CELLS; k++) relay_push(RELAY_CELL1 + k, RELAY_CELL_GUARD); /// * Queue the cell relays off
+}
+
+/**@brief This function adds a step to #relay_queue. The queue is long enough for a mode change and a start.
+* Sequences of steps check #relay_space first, so they are queued whole or not at all
+* @param action RELAY_*, with #RELAY_ON to turn the relay on
+* @param wait control cycles to wait after the step
+* @return false if the queue is full, the step is dropped
+*/
+bool relay_push(uint8_t action, uint8_t wait)
+{
+    uint8_t     next = (relay_head + 1) & RELAY_MASK;
+    bool        gie = GIE;
+    
+    if (next == relay_tail) return false; /// * If the queue is full, the step would make it look empty
+    GIE = 0; /// * Disable the interrupts, #relay_queue is run by the ISR
+    relay_queue[relay_head].action = action;
+    relay_queue[relay_head].wait = wait;
+    relay_head = next;
+    GIE = gie;
+    return true;
+}
+
+/**@brief This function tells how many steps can be added to #relay_queue
+* @return free steps, up to RELAY_SIZE - 1
+*/
+uint8_t relay_space()
+{
+    return (uint8_t) ( (relay_tail - relay_head - 1) & RELAY_MASK );
+}
+
+/**@brief This function queues the steps of the mode relays: both set relays off, a pulse of the set relay of the mode
+* and the ON/OFF relay on, with #RELAY_MODE_GUARD after every step
+* @param discharge 1 for discharge (RC3), 0 for charge (RC4)
+* @return false if the steps do not fit in #relay_queue, then none is queued
+*/
+bool relay_mode(bool discharge)
+{
+    uint8_t     set = discharge ? RELAY_RC3 : RELAY_RC4;
+    
+    if (relay_space() < RELAY_MODE_STEPS) return false;
+    relay_push(RELAY_RC3, 0);
+    relay_push(RELAY_RC4, RELAY_MODE_GUARD);
+    relay_push(set | RELAY_ON, RELAY_MODE_GUARD);
+    relay_push(set, RELAY_MODE_GUARD);
+    relay_push(RELAY_RC5 | RELAY_ON, RELAY_MODE_GUARD);
+    return true;
+}
+
+/**@brief This function runs #relay_queue, it is called from #control_tick on every control cycle.
+* Steps are run until one has a guard time, then it waits for it to be over.
+*/
+void relay_tick()
+{
+    relay_step_type*    step;
+    bool                on;
+    
+    if (relay_wait) /// * Wait for the guard time of the last step
+    {
+        relay_wait--;
+        return;
+    }
+    while (relay_tail != relay_head) /// * Run the next steps
+    {
+        step = &relay_queue[relay_tail];
+        on = (step->action & RELAY_ON) != 0;
+        switch (step->action & ~RELAY_ON)
+        {
+            case RELAY_RC3: RC3 = on; break;
+            case RELAY_RC4: RC4 = on; break;
+            case RELAY_RC5: RC5 = on; break;
+            case RELAY_CELL1: RB2 = on; break;
+            case RELAY_CELL1 + 1: RB3 = on; break;
+            case RELAY_CELL1 + 2: RB4 = on; break;
+            case RELAY_CELL1 + 3: RB5 = on; break;
+            case RELAY_START: /// * #RELAY_START loads the start duty cycle with #feedforward_start, clears #second and turns the converter on
+                feedforward_start();
+                second = 0;
+                ctrl.conv = 1;
+                break;
+            default: break;
+        }
+        relay_wait = step->wait;
+        relay_tail = (relay_tail + 1) & RELAY_MASK;
+        if (relay_wait) return;
+    }
+}
+
+/**@brief This function tells if all the relay steps are done
+* @return true when #relay_queue is empty and the last guard time is over
+*/
+bool relay_ready()
+{
+    return (relay_tail == relay_head) && !relay_wait;
+}
+
+/**@brief This function runs #relay_queue until it is empty, waiting the guard times. Only for #initialize,
+* before the interrupts are enabled
+*/
+void relay_flush()
+{
+    while (!relay_ready())
+    {
+        relay_tick();
+        __delay_us(976);
+    }
+}
@@ -43,42 +43,58 @@
     #include <stdint.h> // To include uint8_t and uint16_t
     #include <string.h>
     #include <stdbool.h> // Include bool type
-
-    bool command_interpreter(void);
-    
-    void converter_settings(void);
-    void initialize(void);
-    void pid(float feedback, float setpoint);
-    void set_DC();
-    uint16_t read_ADC(uint16_t channel);
-    void scaling(void);
-    void cc_cv_mode(uint16_t current_voltage, uint16_t reference_voltage, bool CC_mode_status);
-    void control_loop(void);
-    void calculate_avg(void);
-    void interrupt_enable(void);
+    #include <ctype.h>
     
-    void UART_send_char(char bt);
-    uint8_t UART_get_byte(void);
-    void UART_send_header(uint8_t start, uint8_t operation, uint8_t code);
-    void UART_send_byte(uint8_t byte);
-    void UART_get_some_bytes(uint8_t length, uint8_t* data);
-    void UART_read_until(char* data, char terminator);
-    void UART_send_some_bytes(uint8_t length, uint8_t* data);
-    void UART_send_some_char(uint8_t length, char* data);
-    void put_data_into_structure(uint8_t length, uint8_t* data, uint8_t* structure);
-    void UART_send_string(char* st_pt);
-    void Cell_ON(void);
-    void Cell_OFF(void);
-    void timing(void);
-    
-    #define     ASCII_SELF              'AlexSQ,FQPS,0001,1.0'
+    #define     ASCII_SELF              "AlexSQ,FQPS,0001,1.0"
     #define     ASCII_NEWLINE           '\n'
     
+    #define     SCPI_ARG                0x01 ///< Flag of #scpi_command_type, the command takes a numeric argument
+    #define     SCPI_ARG2               0x02 ///< Flag of #scpi_command_type, the command takes two numeric arguments
+    #define     SCPI_ARG4               0x04 ///< Flag of #scpi_command_type, the command takes four numeric arguments
+    #define     SCPI_ARGS_MASK          0x07 ///< Mask of the number of arguments in the flags of #scpi_command_type
+    #define     SCPI_MAX_ARGS           4 ///< Maximum number of numeric arguments of a command
+    #define     SCPI_MAX_DIGITS         9 ///< Maximum number of digits of a numeric argument, so it fits in 32 bits
+    #define     CONF_GAIN_MAX           100000 ///< Maximum value accepted by the CONFigure commands of the kp and ki gains, xE-6
+    #define     CONF_KD_MAX             4000 ///< Maximum value accepted by CONFigure:CVKD, xE-3. It is #PID_KD_MAX, above it #pid overflows
+    #define     PID_MICRO_TO_Q24(x)     ( (int32_t) (x) * 16 + ( (int32_t) (x) * 12144 ) / 15625 ) ///< Convert a gain in xE-6 to Q8.24. 2^24 / 10^6 = 16 + 12144 / 15625
+    #define     PID_MILLI_TO_Q16(x)     ( ( (int32_t) (x) * 8192 ) / 125 ) ///< Convert a gain in xE-3 to Q16.16. 2^16 / 10^3 = 8192 / 125
+    #define     TELEM_START             0xA5 ///< First byte of a telemetry frame
+    #define     TELEM_OPERATION         0x01 ///< Second byte of a telemetry frame, measurement data
+    #define     TELEM_STATUS            0x02 ///< Second byte of a status frame, it carries the status byte of a command line while the telemetry is on
+    #define     TELEM_STATUS_SIZE       3 ///< Bytes of a status frame before the CRC: #TELEM_START, #TELEM_STATUS and the status
+    #define     TELEM_MIN_PERIOD        8 ///< Minimum control cycles between frames, a frame takes about 4 ms at 57600 bps
+    #define     UART_TX_SIZE            64 ///< Size of the UART transmission ring buffer, must be a power of two
+    #define     UART_TX_MASK            (UART_TX_SIZE - 1) ///< Mask to wrap the indexes of #uart_tx_buffer
+    #define     UART_RX_SIZE            64 ///< Size of the UART reception ring buffer, must be a power of two. A host can send one byte less of commands before their status bytes
+    #define     UART_RX_MASK            (UART_RX_SIZE - 1) ///< Mask to wrap the indexes of #uart_rx_buffer
+    #define     UART_LINE_SIZE          32 ///< Maximum length of a command line, including the null terminator
+    #define     STATIC_CHECK(name, cond) typedef char name[(cond) ? 1 : -1] ///< Stop the build if @p cond is false, the array size is negative
+    #define     BANK_SIZE               80 ///< General purpose RAM bytes of one bank of the PIC16F1786
+    #define     CTRL_BANK               1 ///< RAM bank of #ctrl, the ADC result registers read with it are in bank 1
+    
     #define     _XTAL_FREQ              32000000 ///< Frequency to coordinate delays, 32 MHz
     #define     ERR_MAX                 1000 ///< Maximum permisible error, useful to avoid ringing
     #define     ERR_MIN                 -1000 ///< Minimum permisible error, useful to avoid ringing
+    #define     PID_Q24(x)              ((int32_t) ( (x) * 16777216.0 + 0.5 ) ) ///< Convert a gain to Q8.24, used for #ctrl.kp and #ctrl.ki
+    #define     PID_Q16(x)              ((int32_t) ( (x) * 65536.0 + 0.5 ) ) ///< Convert a gain or duty cycle to Q16.16, used for #ctrl.kd, #ctrl.pidi and #ctrl.pidt
+    #define     PID_Q24_TO_Q16(x)       ( ( (x) + 0x80 ) >> 8 ) ///< Round a Q8.24 product down to Q16.16
+    #define     PID_I_LIMIT             0x10000000 ///< Integral accumulator bound in Q16.16 (4096 duty counts), only to keep the 32-bit sums from overflowing
+    #define     PID_K_MAX               PID_MICRO_TO_Q24(CONF_GAIN_MAX) ///< Largest #ctrl.kp and #ctrl.ki, times #ERR_MAX it fits in 32 bits
+    #define     PID_KD_MAX              PID_Q16(4.0) ///< Largest #ctrl.kd. The error step e - er of #pid reaches ADC_MAX + ERR_MAX = 5095, and 4 * 5095 in Q16.16 plus the other terms stays below 2^31
     #define     V_CHAN                  0b01010 ///< Definition of ADC channel for voltage measurements. AN10(RB1) 
     #define     I_CHAN                  0b01100 ///< Definition of ADC channel for current measurements. AN12(RB0)
+    #define     T_CHAN                  0b00100 ///< Definition of ADC channel for temperature measurements. AN4(RA5)
+    #define     AUX_CHAN                0b11101 ///< Definition of ADC channel of the temperature indicator of the PIC, a spare slow channel
+    #define     ADC_SEQ_FAST            2 ///< Number of conversions done on every Timer1 tick, see #adc_sequence
+    #define     ADC_SEQ_MAX             3 ///< Conversions in a sequence with a slow channel
+    #define     ADC_SLOT_V              0 ///< Position of #V_CHAN in #adc_sequence and #adc_sample
+    #define     ADC_SLOT_I              1 ///< Position of #I_CHAN in #adc_sequence and #adc_sample
+    #define     ADC_SLOT_SLOW           2 ///< Position of the slow channel in #adc_sequence, its result goes to #adc_slow_sample
+    #define     ADC_SLOW_CHANNELS       2 ///< Number of slow channels, converted in turns after the fast ones
+    #define     ADC_SLOW_TEMP           0 ///< Slow channel of the temperature sensor, #T_CHAN
+    #define     ADC_SLOW_AUX            1 ///< Slow channel of the temperature indicator of the PIC, #AUX_CHAN
+    #define     ADC_TEMP_PERIOD         16 ///< Default Timer1 ticks between temperature conversions, about 64 per second
+    #define     ADC_ACQ_COUNT           40 ///< Timer2 period between channel change and conversion start. 40 x 0.125us = 5us of acquisition
     #define     CELL1_ON()              { RB2 = 1; } ///< Turn on Cell #1
     #define     CELL2_ON()              { RB3 = 1; } ///< Turn on Cell #2
     #define     CELL3_ON()              { RB4 = 1; } ///< Turn on Cell #3
@@ -88,22 +104,147 @@
     #define     CELL3_OFF()             { RB4 = 0; } ///< Turn off Cell #3
     #define     CELL4_OFF()             { RB5 = 0; } ///< Turn off Cell #4
 
+    /** @brief Turn off the converter at once*/
+    /** Set @p conv to zero, turn off the main relay (@p RC5) and set the duty cycle in @p DC_MIN. It has no delays, so
+    it is used by #protection_tick from the ISR.
+    */
+    #define     CONVERTER_OFF()         { RC3 = 0; RC4 = 0; ctrl.conv = 0; RC5 = 0; ctrl.pidt = PID_Q16(DC_MIN); set_DC(DC_MIN);}
     /** @brief Stop the converter*/
-    /** Set @p conv to zero, turn off the main relay (@p RC5), set the duty cycle in @p DC_MIN, 
-    turn off all the cell relays in the switcher board, disable the logging of data to the terminal 
-    and the UART reception interrupts.
+    /** Turn off the converter with #CONVERTER_OFF and then all the cell relays in the switcher board. #Cell_OFF cancels the
+    relay steps still queued, so a start in progress does not turn the converter on again.
     */
-    #define     STOP_CONVERTER()        { RC3 = 0; RC4 = 0; conv = 0; RC5 = 0; pidt = DC_MIN; set_DC(); Cell_OFF();}
+    #define     STOP_CONVERTER()        { CONVERTER_OFF(); Cell_OFF();}
     // It seems that above 0.8 of DC the losses are so high that I don't get anything similar to the transfer function 
-    #define     DC_MIN                  50.0  ///< Minimum possible duty cycle, set around @b 0.1 
-    #define     DC_MAX                  300.0  ///< Maximum possible duty cycle, set around @b 0.8
+    #define     RELAY_RC3               0 ///< Relay step: RC3, set for discharge
+    #define     RELAY_RC4               1 ///< Relay step: RC4, set for charge
+    #define     RELAY_RC5               2 ///< Relay step: RC5, ON/OFF relay
+    #define     RELAY_CELL1             3 ///< Relay step: RB2, cell #1. The next three are cells #2 to #4
+    #define     RELAY_WAIT              7 ///< Relay step: only wait
+    #define     RELAY_START             8 ///< Relay step: start the converter, the last step of #converter_settings
+    #define     RELAY_MODE_STEPS        5 ///< Steps queued by #relay_mode
+    #define     RELAY_START_STEPS       (CELLS + 2) ///< Steps queued by #converter_settings, #Cell_ON and the start
+    #define     RELAY_ON                0x80 ///< Flag of a relay step, turn the relay on. Without it, it is turned off
+    #define     RELAY_SIZE              16 ///< Size of the relay step queue, must be a power of two
+    #define     RELAY_MASK              (RELAY_SIZE - 1) ///< Mask to wrap the indexes of #relay_queue
+    #define     RELAY_MS(x)             ( (uint8_t) ( ( (x) * 1025UL + 500 ) / 1000 ) ) ///< Convert ms to control cycles, up to 248 ms
+    #define     RELAY_MODE_GUARD        RELAY_MS(100) ///< Guard time after every step of the mode relays
+    #define     RELAY_CELL_GUARD        RELAY_MS(10) ///< Guard time after every step of the cell relays
+    #define     CELLS                   4 ///< Number of cells in the switcher board
+    #define     CELLS_MASK              0x0F ///< Mask with every cell of the switcher board
+    #define     CELL_IDLE               0 ///< Cell status: not part of the session
+    #define     CELL_QUEUED             1 ///< Cell status: waiting for its turn
+    #define     CELL_RUNNING            2 ///< Cell status: under test
+    #define     CELL_DONE               3 ///< Cell status: the test reached an end limit
+    #define     CELL_STOPPED            4 ///< Cell status: the test was stopped by a protection or by the user
+    #define     SCHED_LINE_MAX          24 ///< Longest line sent by SCHED:RES?
+    #define     LOG_BLOCKS              4 ///< Blocks of #log_blocks, must be a power of two. Every block takes 35 bytes of RAM
+    #define     LOG_MASK                (LOG_BLOCKS - 1) ///< Mask to wrap the indexes of #log_blocks
+    #define     LOG_DELTAS              7 ///< Delta records after the first record of a block
+    #define     LOG_FIELDS              4 ///< Fields of a record: voltage, current, capacity and temperature, like #log_data
+    #define     LOG_SLOW_MAX            7 ///< Largest change of the capacity and the temperature in a delta record, they take 4 bits each
+    #define     LOG_BURST               8 ///< Most records sent by one LOG:DATA?
+    #define     LOG_LINE_MAX            36 ///< Longest line sent by LOG:DATA?
+    #define     END_NONE                0 ///< #end_cause: the converter is running or was never started
+    #define     END_LIMIT               1 ///< #end_cause: an end of charge or discharge limit was reached
+    #define     END_PROT                2 ///< #end_cause: a protection limit was exceeded
+    #define     END_USER                3 ///< #end_cause: stopped with OUTP:STOP, SCHED:STOP or PROF:STOP
+    #define     FAULT_NONE              0 ///< #prot_fault: no fault latched
+    #define     FAULT_OVP               1 ///< #prot_fault: over-voltage, above #v_prot
+    #define     FAULT_OCP               2 ///< #prot_fault: over-current, above #i_prot
+    #define     FAULT_UVP               3 ///< #prot_fault: under-voltage, below #v_uvp
+    #define     FAULT_OTP               4 ///< #prot_fault: over-temperature, #t_prot reached
+    #define     PROT_DEBOUNCE           3 ///< Default samples in a row beyond a limit before the protection trips
+    #define     END_ERROR               4 ///< #end_cause: the profile has a wrong step
+    #define     PROFILE_EE_ADDR         0x00 ///< Data EEPROM address of the first profile step
+    #define     PROFILE_STEPS           16 ///< Number of profile steps in data EEPROM
+    #define     PROFILE_STEP_SIZE       5 ///< Bytes per profile step: code and two 16-bit arguments, little endian
+    #define     PROFILE_GUARD           32 ///< Maximum steps executed at once by #profile_execute
+    #define     PROF_OP_END             0 ///< Profile step: end of the profile
+    #define     PROF_OP_CHARGE          1 ///< Profile step: CC-CV charge at arg1 mA, CV at arg2 mV, until the end of charge limits
+    #define     PROF_OP_DISCHARGE       2 ///< Profile step: CC discharge at arg1 mA down to arg2 mV
+    #define     PROF_OP_REST            3 ///< Profile step: rest arg1 seconds
+    #define     PROF_OP_LOOP            4 ///< Profile step: go back to step arg1, arg2 times
+    #define     PROF_OP_ENDC            5 ///< Profile step: end of charge current arg1 mA and voltage arg2 mV, 0 disables them
+    #define     PROF_OP_LAST            PROF_OP_ENDC ///< Highest valid step code
+    #define     CAL_V                   0 ///< Calibration channel of the voltage
+    #define     CAL_I                   1 ///< Calibration channel of the current
+    #define     CAL_T                   2 ///< Calibration channel of the temperature
+    #define     CAL_CHANNELS            3 ///< Number of calibration channels
+    #define     CAL_SHIFT               12 ///< The gains are in units per 2^12 counts
+    #define     CAL_ROUND               (1 << (CAL_SHIFT - 1)) ///< Half LSB, to round after the shift
+    #define     CAL_V_GAIN              5000 ///< Nominal voltage gain: 5000 mV full scale on 4096 counts
+    #define     CAL_I_GAIN              12500 ///< Nominal current gain: 5000 mV full scale and 0.4 V/A sensitivity
+    #define     CAL_T_GAIN              5000 ///< Nominal temperature gain: the sensor voltage in mV
+    #define     ADC_MAX                 4095 ///< Maximum value of the 12-bit ADC
+    #define     FILT_AVERAGE            0 ///< #filt_type: average of every window of samples, decimated to one output per window
+    #define     FILT_IIR                1 ///< #filt_type: first order IIR with a time constant of one window, run on the window averages
+    #define     FILT_IIR_GAIN           162 ///< Step of #FILT_IIR on every window average, in 1/256. It is 1 - e^-1, so the time constant is one window
+    #define     FILT_CHANNELS           3 ///< Number of filtered channels, in the order of the calibration channels, see #filt_source
+    #define     FILT_FRAC_BITS          4 ///< Extra bits of #filt_out obtained by oversampling, it is in 1/16 ADC counts
+    #define     FILT_SHIFT_MIN          6 ///< Shortest window, 2^6 samples. About 16 outputs per second
+    #define     FILT_SHIFT_MAX          10 ///< Longest window, 2^10 samples. About 1 output per second
+    #define     COUL_CHARGE             0 ///< Index of the charge totals in #coulomb and #coul_acum, same as #ctrl.dmode
+    #define     COUL_DISCHARGE          1 ///< Index of the discharge totals in #coulomb and #coul_acum, same as #ctrl.dmode
+    #define     COUL_TICKS              (COUNTER + 1) ///< Timer1 ticks in one #second, #timing reloads #ctrl.count after reaching 0
+    #define     CONFIG_EE_ADDR          0x50 ///< Data EEPROM address of the first configuration slot, after the profile
+    #define     CONFIG_SLOTS            ( (256 - CONFIG_EE_ADDR) / sizeof(config_type) ) ///< Number of configuration slots, used in turns to spread the wear
+    #define     CONFIG_VERSION          2 ///< Layout version of #config_type, slots with other versions are ignored
+    #define     TUNE_IDLE               0 ///< #tune_state: no identification was run
+    #define     TUNE_DONE               1 ///< #tune_state: the identification finished, the gains can be read with TUNE:RES?
+    #define     TUNE_FAIL               2 ///< #tune_state: the response was too small or too slow, or the converter stopped
+    #define     TUNE_SETTLE             3 ///< #tune_state: holding the duty cycle to measure the starting point
+    #define     TUNE_STEP               4 ///< #tune_state: duty cycle stepped up, measuring the final value
+    #define     TUNE_RETURN             5 ///< #tune_state: duty cycle back, measuring the time constant
+    #define     TUNE_PHASE              256 ///< Control cycles of every phase of the identification
+    #define     TUNE_AVG_SHIFT          6 ///< The last 2^6 samples of a phase are averaged
+    #define     TUNE_STEP_MAX           100 ///< Largest duty cycle step accepted by TUNE:START
+    #define     TUNE_FILTER_LAG         3 ///< Delay in control cycles of the feedback filter of #tune_tick, subtracted from #tune_tau
+    #define     TUNE_DY_MIN             8 ///< Smallest response in ADC counts that gives usable gains
+    #define     PROF_IDLE               0 ///< #prof_state: no step waiting
+    #define     PROF_CONVERTER          1 ///< #prof_state: waiting for the converter to reach an end limit
+    #define     PROF_REST               2 ///< #prof_state: waiting for the rest time
+    #define     CV_FILT_SHIFT           3 ///< The voltage checked by #cc_cv_mode is filtered with a time constant of 2^3 samples
+    #define     DC_DITHER_BITS          4 ///< Fraction bits of #ctrl.pidt kept by the dither of #pid, 9 + 4 = 13 bits of duty cycle
+    #define     DC_DITHER_MASK          ( (1 << DC_DITHER_BITS) - 1 ) ///< Mask of the fraction of #ctrl.dc_dither
+    #define     DC_PERIOD               512 ///< Duty cycle counts of one PSMC period, see #initialize
+    #define     FF_MARGIN               8 ///< The converter starts this many duty counts below the estimate of #feedforward_start
+    #define     FF_SLEW_DEF             128 ///< Default #ff_slew, duty counts per second
+    #define     DC_MIN                  50  ///< Minimum possible duty cycle, set around @b 0.1 
+    #define     DC_MAX                  300  ///< Maximum possible duty cycle, set around @b 0.8
     #define     COUNTER                 1024  ///< Counter value, needed to obtained one second between counts.
-    ////////////////////////////////////////////////////////////////////////////////////
-    // Function mode settings
-    #define     SET_DISC()              { RC3 = 0; RC4 = 0; __delay_ms(100); RC3 = 1; __delay_ms(100); RC3 = 0; __delay_ms(100); RC5 = 1; __delay_ms(100); kp = CC_disc_kp; ki = CC_disc_ki; kd = (float) (CC_char_disc_kd); pidi = 0.0;}
-    #define     SET_CHAR()              { RC3 = 0; RC4 = 0; __delay_ms(100); RC4 = 1; __delay_ms(100); RC4 = 0; __delay_ms(100); RC5 = 1; __delay_ms(100); kp = CC_char_kp; ki = CC_char_ki; kd = (float) (CC_char_disc_kd); pidi = 0.0;}
-    
+    #define     PROFILE_ENABLE          1 ///< Set to 0 to remove the ISR profiler
+    #define     PROF_ISR                0 ///< Profiled stage: Timer1 branch of the ISR, from the reload to the end
+    #define     PROF_LATENCY            1 ///< Profiled stage: time from the Timer1 overflow to the ISR entry
+    #define     PROF_ADC                2 ///< Profiled stage: starting the ADC sequence
+    #define     PROF_CONTROL            3 ///< Profiled stage: #control_sample, in the ADC interrupt
+    #define     PROF_AVG                4 ///< Profiled stage: #calculate_avg
+    #define     PROF_TIMING             5 ///< Profiled stage: #timing and #telemetry_sample
+    #define     PROF_STAGES             6 ///< Number of profiled stages
+    #define     PROF_BINS               4 ///< Number of histogram bins per stage, every bin takes 2 bytes of RAM per stage
+    #define     PROF_BIN_FIRST          32 ///< Upper limit of the first histogram bin, 32 x 0.125us = 4us
+    #define     PROF_BIN_SHIFT          2 ///< Every histogram bin is 4 times as wide as the previous one: 4us, 16us, 64us and above
+    #define     TASKS                   5 ///< Number of entries of #tasks
+    #define     TASK_LINE_MAX           24 ///< Longest line sent by DIAG:TASK?
+    #define     PROF_FIELD_MAX          7 ///< Longest field sent by DIAG:TIM?: a comma, 5 digits and the newline. A whole line does not fit in #uart_tx_buffer
+    #if PROFILE_ENABLE
+        #define     PROFILE_MARK(t)             ( (t) = profile_now() ) ///< Store in @p t the time stamp at the beginning of a profiled stage
+        #define     PROFILE_RECORD(stage, t)    ( (t) = profile_record(stage, t) ) ///< Record a stage that started at @p t, and store in @p t the start of the next one
+        #define     PROFILE_ADD(stage, d)       profile_add(stage, d) ///< Record a duration @p d
+    #else /// The time stamp variables are only declared when the profiler is enabled, so the macros do not use their arguments
+        #define     PROFILE_MARK(t)             ((void)0)
+        #define     PROFILE_RECORD(stage, t)    ((void)0)
+        #define     PROFILE_ADD(stage, d)       ((void)0)
+    #endif
+
     //Structs  
+    /** @brief Entry of the SCPI command table*/
+    typedef struct scpi_command_struct {
+        const char* pattern; ///< Header in long form, the short form is the upper case part
+        bool (*handler)(void* target, int32_t value); ///< Function that executes the command
+        void* target; ///< Variable used by @p handler, if any
+        uint8_t flags; ///< Number of numeric arguments, #SCPI_ARG or #SCPI_ARG4
+    }scpi_command_type;
+    
     typedef struct log_data_struct {
         uint16_t voltage;
         uint16_t current;
@@ -111,56 +252,368 @@
         uint16_t temperature;
     }log_data_type, *log_data_type_ptr;
     
-    //Variables
-      
-    log_data_type                       log_data;
-    log_data_type_ptr                   log_data_ptr;
-    bool                                SECF = 1; ///< 1 second flag
-    bool                                SRXF = 0; ///< Serial Reception Flag
-    uint16_t                            capacity; ///< Definition of capacity per cell according to each chemistry
-    uint16_t                            i_char; ///< Charging current in mA
-    uint16_t                            i_disc; ///< Discharging current in mA
-    unsigned char                       cell_count = 1; ///< Cell counter from '1' to '4'. Initialized as '1'
-    
-    // last test with LI_ION gave this constants
-    float                               CV_kp = 0.0018;  ///< Proportional constant for CV mode
-    float                               CV_ki = 0.0005;  ///< Integral constant for CV mode 
-    float                               CV_kd = 0.020; ///< Diferential constant for CV mode 
-    
-    // last test with LI_ION gave this constants MAYBE OK ALEX
-    float                               CC_char_kp = 0.003;  ///< Proportional constant divider for CC mode
-    float                               CC_char_ki = 0.0005;  ///< Integral constant for CC mode 
-    float                               CC_disc_kp = 0.006;   ///< Proportional constant for CC mode
-    float                               CC_disc_ki = 0.001;   ///< Integral constant for CC mode
-    uint8_t                             CC_char_disc_kd = 0;  ///< Diferential constant for CC mode 
-    
-    bool                                conv = 0; ///< Turn controller ON(1) or OFF(0). Initialized as 0
-    uint16_t                            count = COUNTER; ///< Counter that should be cleared every second. Initialized as #COUNTER 
-    /**< Every control loop cycle this counter will be decreased. This variable is used to calculate the averages and to trigger
-    all the events that are done every second.*/
-    //uint16_t                            ad_res; ///< Result of an ADC measurement.
-    uint16_t                            v;  ///< Last voltage ADC measurement.
-    uint16_t                            i;  ///< Last current ADC measurement.
-    uint24_t                            vacum = 0; ///< accumulator dor v
-    uint24_t                            iacum = 0;
-    //qavg does not need accumulator
-    uint16_t                            vavg = 0;  ///< Last one-second-average of #v . Initialized as 0
-    uint16_t                            const_vol = 0;
-    uint16_t                            iavg = 0;  ///< Last one-second-average of #i . Initialized as 0
-    uint16_t                            const_cur = 0;
-    float                               qavg = 0.0;  ///< Integration of #i . Initialized as 0
-    uint16_t                            vmax = 0;   ///< Maximum recorded average voltage. 
-    float                               pidi;   ///< Integral acumulator of PI compensator
-    float                               kp;  ///< Proportional compesator gain
-    float                               ki;  ///< Integral compesator gain
-    float                               kd;  ///< Diferential compesator gain
-    float                               v_ref = 0;  ///< Scaled voltage setpoint. Initialized as 0
-    uint16_t                            i_ref = 0;  ///< Current setpoint. Initialized as 0
-    bool                                cmode = 1;  ///< CC / CV selector. CC: <tt> cmode = 1 </tt>. CV: <tt> cmode = 0 </tt>   
-    float                               pidt = 0;  ///< Duty cycle
-    float                               er = 0; /// < Define er for calculating the error on dc calculus    
-    uint16_t                            second = 0; ///< Seconds counter
-    uint16_t                            timeout = 0;
+    /** @brief Binary telemetry frame, sent little endian and COBS encoded by #telemetry_send*/
+    typedef struct telem_frame_struct {
+        uint8_t start; ///< #TELEM_START
+        uint8_t operation; ///< #TELEM_OPERATION
+        uint8_t code; ///< Status: bit 0 #ctrl.cmode, bit 1 #ctrl.dmode, bit 2 #ctrl.conv
+        uint8_t sequence; ///< Frame counter, to detect lost frames
+        uint16_t second; ///< #second when the snapshot was taken
+        uint16_t count; ///< #ctrl.count when the snapshot was taken
+        uint16_t v; ///< Last voltage ADC measurement
+        uint16_t i; ///< Last current ADC measurement, without bias
+        log_data_type log; ///< Last one-second-average values
+    }telem_frame_type;
+    
+    /** @brief Entry of the task table run by #task_run*/
+    typedef struct task_struct {
+        void (*run)(void); ///< Function of the task
+        uint16_t period; ///< Control cycles between releases
+        uint16_t deadline; ///< Control cycles after the release to start it, a later start is counted in #task_missed
+        const char* name; ///< Name sent by DIAG:TASK?
+    }task_type;
+    
+    /** @brief Execution time statistics of one profiled stage, in Timer1 ticks of 0.125us*/
+    typedef struct profile_struct {
+        uint16_t min; ///< Shortest duration
+        uint16_t max; ///< Longest duration
+        uint32_t sum; ///< Sum of the durations, for the mean
+        uint16_t n; ///< Number of measurements, it stops at 65535
+        uint16_t hist[PROF_BINS]; ///< Histogram, bin 0 is below #PROF_BIN_FIRST and every bin is 4 times as wide, see #PROF_BIN_SHIFT
+    }profile_type;
+    
+    /** @brief Result of one cell in a scheduled session*/
+    typedef struct cell_result_struct {
+        uint16_t capacity; ///< Capacity in mAh when the test ended
+        uint16_t time; ///< Seconds since the cell started, over all the stages of its profile
+        uint8_t status; ///< CELL_*
+    }cell_result_type;
+    
+    /** @brief Step of a charge/discharge profile, stored in #PROFILE_STEP_SIZE bytes of data EEPROM*/
+    typedef struct profile_step_struct {
+        uint8_t op; ///< PROF_OP_*
+        uint16_t arg1; ///< First argument, its meaning depends on @p op
+        uint16_t arg2; ///< Second argument, its meaning depends on @p op
+    }profile_step_type;
+    
+    /** @brief Step of the relay sequence, see #relay_tick*/
+    typedef struct relay_step_struct {
+        uint8_t action; ///< RELAY_*, with #RELAY_ON to turn the relay on
+        uint8_t wait; ///< Control cycles to wait after the step
+    }relay_step_type;
+    
+    /** @brief Calibration of one measurement channel: value = counts x gain / 4096 + offset*/
+    typedef struct cal_struct {
+        int16_t offset; ///< Offset in mV, mA or the temperature unit
+        uint16_t gain; ///< Gain in units per 4096 counts
+    }cal_type;
+    
+    /** @brief Delta record of the RAM log, the changes of the fields from the record before*/
+    typedef struct log_delta_struct {
+        int8_t voltage; ///< Change of the voltage
+        int8_t current; ///< Change of the current
+        uint8_t slow; ///< Change of the capacity in the high nibble and of the temperature in the low nibble, signed 4-bit each
+    }log_delta_type;
+    
+    /** @brief Block of the RAM log: a full record and the changes of the next ones, see #log_record*/
+    typedef struct log_block_struct {
+        uint16_t sequence; ///< Sequence number of the first record
+        uint16_t second; ///< #second of the first record
+        uint8_t decimation; ///< Seconds between the records of the block
+        uint8_t count; ///< Records in the block, the first one and @p count - 1 deltas
+        log_data_type first; ///< First record
+        log_delta_type delta[LOG_DELTAS]; ///< Change of every field from the record before
+    }log_block_type;
+    
+    /** @brief Charge and energy totals of one direction, integrated by #coulomb_update without losing the fractions*/
+    typedef struct coulomb_struct {
+        uint32_t charge; ///< Charge in mAs
+        uint32_t energy; ///< Energy in mWs
+        uint16_t cal_rem; ///< Remainder of the calibration shift, in 1/4096 mA ticks
+        uint16_t tick_rem; ///< Remainder of the division by #COUL_TICKS, in mA ticks
+        uint16_t energy_rem; ///< Remainder of the division by 1000, in uWs
+    }coulomb_type;
+    
+    /** @brief Configuration block saved in the data EEPROM slots*/
+    typedef struct config_struct {
+        uint8_t version; ///< #CONFIG_VERSION
+        uint8_t sequence; ///< Incremented on every save, the newest slot is loaded
+        int32_t CV_kp; ///< #CV_kp
+        int32_t CV_ki; ///< #CV_ki
+        int32_t CV_kd; ///< #CV_kd
+        int32_t CC_char_kp; ///< #CC_char_kp
+        int32_t CC_char_ki; ///< #CC_char_ki
+        int32_t CC_disc_kp; ///< #CC_disc_kp
+        int32_t CC_disc_ki; ///< #CC_disc_ki
+        uint8_t CC_char_disc_kd; ///< #CC_char_disc_kd
+        cal_type cal[CAL_CHANNELS]; ///< #cal
+        uint16_t crc; ///< CRC-16/CCITT of the previous bytes
+    }config_type;
+    
+    /** @brief State read or written by the control ISR on every tick. It is kept in one block, #ctrl, placed in bank #CTRL_BANK
+    * with __bank(), so the ISR path does not switch banks between these variables. The project builds with -maddrqual=require,
+    * so XC8 stops if it cannot honour the placement. It takes 46 bytes on XC8, a bank has #BANK_SIZE bytes.
+    * Configuration that is only read once in a while stays in separate variables.
+    */
+    typedef struct control_struct {
+        int32_t pidt; ///< Duty cycle, Q16.16 so the fraction is kept between control cycles
+        int32_t pidi; ///< Integral acumulator of PI compensator, Q16.16 duty counts
+        int32_t kp; ///< Proportional compesator gain, Q8.24
+        int32_t ki; ///< Integral compesator gain, Q8.24
+        int32_t kd; ///< Diferential compesator gain, Q16.16
+        int32_t ss_limit; ///< Soft start ceiling of #ctrl.pidt, Q16.16, it rises by #ff_slew up to #DC_MAX
+        uint16_t v; ///< Last voltage ADC measurement
+        uint16_t i; ///< Last current ADC measurement, without bias
+        uint16_t t; ///< Last temperature ADC measurement
+        uint16_t v_ref; ///< Scaled voltage setpoint
+        uint16_t i_ref; ///< Scaled current setpoint
+        uint16_t cv_vf; ///< #ctrl.v filtered for #cc_cv_mode, in 1/16 ADC counts
+        uint16_t count; ///< Decreased every control cycle and reloaded with #COUNTER by #timing, one second per turn
+        uint16_t task_ticks; ///< Control cycles since the reset, the time base of #task_run
+        int16_t er; ///< Clamped error of the last control cycle, for the differential term
+        uint8_t dc_dither; ///< Fraction of the duty cycle carried between control cycles by #pid
+        bool conv; ///< Turn controller ON(1) or OFF(0)
+        bool cmode; ///< CC / CV selector. CC: <tt> cmode = 1 </tt>. CV: <tt> cmode = 0 </tt>
+        bool dmode; ///< Charge / discharge selector. Charge: <tt> dmode = 0 </tt>. Discharge: <tt> dmode = 1 </tt>
+    }control_type;
+    
+    bool command_interpreter(char* data);
+    char* scpi_match(const char* pattern, char* input);
+    bool scpi_parse_numbers(const char* arg, int32_t* values, uint8_t count);
+    void set_gains(void);
+    bool set_mode(bool discharge);
+    void check_limits(void);
+    bool tune_start(uint8_t step);
+    void tune_tick(void);
+    bool tune_gains(int32_t* gain_kp, int32_t* gain_ki);
+    void protection_update(void);
+    void protection_tick(void);
+    
+    bool converter_settings(void);
+    uint16_t cal_to_units(uint8_t channel, uint16_t counts);
+    uint16_t cal_from_units(uint8_t channel, uint16_t value);
+    uint16_t cal_to_units_fine(uint8_t channel, uint16_t value);
+    void filter_set(uint8_t type, uint8_t shift);
+    void cal_reset(void);
+    void set_current_ref(uint16_t current);
+    void set_voltage_ref(uint16_t voltage);
+    void profile_read_step(uint8_t index, profile_step_type* step);
+    void profile_write_step(uint8_t index, profile_step_type* step);
+    bool profile_start(void);
+    void profile_stop(void);
+    bool profile_execute(void);
+    void profile_update(void);
+    bool config_read_slot(uint8_t slot, config_type* cfg);
+    uint8_t config_find(config_type* cfg);
+    bool config_load(void);
+    void config_save(void);
+    bool scheduler_start(void);
+    bool scheduler_next(void);
+    void scheduler_update(void);
+    void scheduler_stop(void);
+    void initialize(void);
+    uint16_t pid(uint16_t feedback, uint16_t setpoint);
+    void set_DC(uint16_t dc);
+    void ADC_start_sequence(void);
+    void ADC_conversion_done(void);
+    void ADC_acquisition_done(void);
+    void temperature_check(void);
+    void scaling(void);
+    void coulomb_update(void);
+    void coulomb_reset(void);
+    void log_record(void);
+    void log_clear(void);
+    void cc_cv_mode(void);
+    void feedforward_start(void);
+    void control_tick(void);
+    void control_sample(void);
+    void control_loop(void);
+    void calculate_avg(void);
+    void interrupt_enable(void);
+    
+    void UART_send_char(char bt);
+    bool UART_get_byte(uint8_t* byte);
+    void UART_send_header(uint8_t start, uint8_t operation, uint8_t code);
+    void UART_send_byte(uint8_t byte);
+    bool UART_read_until(char* data, char terminator);
+    void UART_send_some_bytes(uint8_t length, uint8_t* data);
+    void UART_send_some_char(uint8_t length, char* data);
+    void put_data_into_structure(uint8_t length, uint8_t* data, uint8_t* structure);
+    void UART_send_string(char* st_pt);
+    void UART_send_number(int32_t number);
+    void UART_tx_isr(void);
+    uint16_t UART_get_tx_overflow(void);
+    void UART_rx_isr(void);
+    uint8_t UART_get_tx_free(void);
+    void UART_wait_tx(uint8_t length);
+    uint16_t profile_now(void);
+    void profile_add(uint8_t stage, uint16_t elapsed);
+    uint16_t profile_record(uint8_t stage, uint16_t start);
+    void profile_send_field(int32_t value);
+    void profile_reset(void);
+    void telemetry_sample(void);
+    void telemetry_send(void);
+    void telemetry_status(bool status);
+    bool frame_send(uint8_t length, uint8_t* data);
+    uint16_t crc16(uint8_t length, uint8_t* data);
+    bool Cell_ON(void);
+    void Cell_OFF(void);
+    bool relay_push(uint8_t action, uint8_t wait);
+    uint8_t relay_space(void);
+    bool relay_mode(bool discharge);
+    void relay_tick(void);
+    bool relay_ready(void);
+    void relay_flush(void);
+    void timing(void);
+    uint16_t task_now(void);
+    void task_run(void);
+    void task_protection(void);
+    void task_measure(void);
+    void task_second(void);
+    void task_command(void);
+    void task_telemetry(void);
+    
+    //Variables, defined in charger_discharger.c
+    
+    extern __bank(CTRL_BANK) control_type      ctrl;
+    extern log_data_type                       log_data;
+    extern bool                                SRXF;
+    extern uint16_t                            capacity;
+    extern uint16_t                            i_char;
+    extern uint16_t                            i_disc;
+    extern unsigned char                       cell_count;
+    
+    extern int32_t                             CV_kp;
+    extern int32_t                             CV_ki;
+    extern int32_t                             CV_kd;
+    
+    extern int32_t                             CC_char_kp;
+    extern int32_t                             CC_char_ki;
+    extern int32_t                             CC_disc_kp;
+    extern int32_t                             CC_disc_ki;
+    extern uint8_t                             CC_char_disc_kd;
+    
+    extern uint8_t                             adc_sequence[ADC_SEQ_MAX];
+    extern uint8_t                             adc_seq_len;
+    extern uint16_t                            adc_sample[ADC_SEQ_FAST];
+    extern uint8_t                             adc_slot;
+    extern const uint8_t                       adc_slow_channel[ADC_SLOW_CHANNELS];
+    extern uint16_t                            adc_slow_period[ADC_SLOW_CHANNELS];
+    extern uint16_t                            adc_slow_countdown[ADC_SLOW_CHANNELS];
+    extern uint16_t                            adc_slow_sample[ADC_SLOW_CHANNELS];
+    extern uint8_t                             adc_slow_pending;
+    extern uint8_t                             adc_slow_next;
+    extern uint16_t                            adc_overrun;
+    extern uint16_t* const                     filt_source[FILT_CHANNELS];
+    extern int32_t                             filt_acum[FILT_CHANNELS];
+    extern uint16_t                            filt_out[FILT_CHANNELS];
+    extern uint8_t                             filt_type;
+    extern uint8_t                             filt_shift;
+    extern uint16_t                            filt_count;
+    extern bool                                filt_seed;
+    extern bool                                filt_ready;
+    extern uint16_t                            vavg;
+    extern uint16_t                            const_vol;
+    extern uint16_t                            iavg;
+    extern uint16_t                            const_cur;
+    extern uint16_t                            tavg;
+    extern cal_type                            cal[CAL_CHANNELS];
+    extern uint16_t* const                     cal_source[CAL_CHANNELS];
+    extern uint16_t                            cal_low_counts[CAL_CHANNELS];
+    extern uint16_t                            cal_low_value[CAL_CHANNELS];
+    extern uint32_t                            coul_acum[2];
+    extern uint16_t                            coul_ticks[2];
+    extern coulomb_type                        coulomb[2];
+    extern uint16_t                            vmax;
+    extern uint16_t                            v_prot;
+    extern uint16_t                            i_prot;
+    extern uint16_t                            v_uvp;
+    extern uint16_t                            prot_v_high;
+    extern uint16_t                            prot_i_high;
+    extern uint16_t                            prot_v_low;
+    extern uint8_t                             prot_count[FAULT_UVP];
+    extern uint8_t                             prot_debounce;
+    extern uint8_t                             prot_fault;
+    extern relay_step_type                     relay_queue[RELAY_SIZE];
+    extern uint8_t                             relay_head;
+    extern uint8_t                             relay_tail;
+    extern uint8_t                             relay_wait;
+    extern bool                                prot_pending;
+    extern uint16_t                            v_endc;
+    extern uint16_t                            i_endc;
+    extern uint16_t                            t_prot;
+    extern uint16_t                            t_derate;
+    extern uint16_t                            v_endd;
+    extern uint8_t                             end_cause;
+    extern uint8_t                             sched_mask;
+    extern bool                                sched_active;
+    extern cell_result_type                    cell_results[CELLS];
+    extern bool                                sched_profile;
+    extern bool                                prof_active;
+    extern uint8_t                             prof_pc;
+    extern uint8_t                             prof_state;
+    extern uint16_t                            prof_rest;
+    extern uint8_t                             prof_loop[PROFILE_STEPS];
+    extern uint16_t                            prof_saved[3];
+    extern uint8_t                             tune_state;
+    extern bool                                tune_cmode;
+    extern bool                                tune_dmode;
+    extern uint16_t                            tune_timer;
+    extern uint16_t                            tune_d0;
+    extern uint8_t                             tune_step;
+    extern uint24_t                            tune_acum;
+    extern uint16_t                            tune_y0;
+    extern uint16_t                            tune_y63;
+    extern uint16_t                            tune_yf;
+    extern uint16_t                            tune_dy;
+    extern uint16_t                            tune_tau;
+    extern int32_t                             scpi_args[SCPI_MAX_ARGS];
+    extern const scpi_command_type             scpi_commands[];
+    extern const uint8_t                       scpi_command_count;
+    extern uint16_t                            ff_bus;
+    extern uint16_t                            ff_res;
+    extern uint16_t                            ff_slew;
+    extern uint16_t                            ff_duty;
+    extern uint16_t                            second;
+    extern uint16_t                            timeout;
+    extern uint8_t                             uart_tx_buffer[UART_TX_SIZE];
+    extern volatile uint8_t                    uart_tx_head;
+    extern volatile uint8_t                    uart_tx_tail;
+    extern uint16_t                            uart_tx_overflow;
+    extern uint8_t                             uart_rx_buffer[UART_RX_SIZE];
+    extern volatile uint8_t                    uart_rx_head;
+    extern volatile uint8_t                    uart_rx_tail;
+    extern uint16_t                            uart_rx_overflow;
+    extern uint16_t                            uart_rx_overrun;
+    extern char                                uart_line[UART_LINE_SIZE];
+    extern uint8_t                             uart_line_index;
+    extern profile_type                        profile[PROF_STAGES];
+    extern const char* const                   profile_names[PROF_STAGES];
+    extern const task_type                     tasks[TASKS];
+    extern log_block_type                      log_blocks[LOG_BLOCKS];
+    extern log_data_type                       log_last;
+    extern uint8_t                             log_head;
+    extern uint8_t                             log_used;
+    extern bool                                log_enabled;
+    extern uint8_t                             log_decimation;
+    extern uint8_t                             log_countdown;
+    extern uint16_t                            log_second;
+    extern uint16_t                            log_sequence;
+    extern uint16_t                            log_read;
+    extern uint16_t                            log_high;
+    extern uint16_t                            log_lost;
+    extern uint16_t                            task_release[TASKS];
+    extern uint16_t                            task_missed[TASKS];
+    extern uint16_t                            timing_errors;
+    extern bool                                uart_line_discard;
+    extern telem_frame_type                    telem_frame;
+    extern bool                                telem_enabled;
+    extern bool                                telem_pending;
+    extern uint16_t                            telem_period;
+    extern uint16_t                            telem_countdown;
+    extern uint8_t                             telem_sequence;
+    extern uint16_t                            telem_dropped;
+
 #endif /* CHARGER_DISCHARGER_H */
 
 
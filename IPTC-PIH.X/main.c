@@ -18,7 +18,7 @@
 
 #include "charger_discharger.h"
 
-/**@brief <b> This is the main function of the program. It initializes the system in every reset and takes care of several tasks that are excecuted every second. </b>
+/**@brief <b> This is the main function of the program. It initializes the system in every reset and runs the tasks of the main loop. </b>
 */
 
 void main(void) /// This function performs the folowing tasks:                     
@@ -28,54 +28,68 @@ void main(void) /// This function performs the folowing tasks:
     interrupt_enable(); // this I added for the test
     while(1) /// <li> <b> The main loop repeats the following forever: </b> 
     {
-        if (SECF) /// <ul> <li> Check the #SECF flag, if it is set, 1 second has passed since last execution, so the folowing task are executed:
-        {
-            scaling(); /// <li> Scale the average measured values by calling the #scaling function
-            
-            if (cmode == 1){ // When on CC, the voltage limit is reached, it pases to CV
-                cc_cv_mode(vavg, const_vol, cmode); /// <li> Check if the system shall change to CV mode by calling the #cc_cv_mode function
-            }
-            
-            SECF = 0; /// <ol> <li> Clear the #SECF flag to restart the 1 second timer
-        }
+        task_run(); /// <ul> <li> Run the next released task of #tasks by calling #task_run. They are, in order of priority:
+        /// <ul> <li> #task_protection, finish a stop of the protection
+        /// <li> #task_measure, scale the filter outputs and check the temperature
+        /// <li> #task_second, the coulomb counter, the end limits, the profile and the scheduled session, once per second
+        /// <li> #task_command, execute the SCPI commands
+        /// <li> #task_telemetry, send the telemetry frames </ul> </ul>
 	}
 }
 
-/**@brief <b> This is the interruption service function. It will interrupt the code whenever the Timer1 overflow (0.975625 milliseconds) or when any character is received from the serial terminal via UART. </b>
+/**@brief <b> This is the interruption service function. It will interrupt the code whenever the Timer1 overflow (0.975625 milliseconds), when any character is received from the serial terminal via UART or when the ADC sequence needs attention. </b>
 */
 void __interrupt() ISR(void) /// This function performs the folowing tasks: 
 {
+#if PROFILE_ENABLE
+    uint16_t    mark;
+#endif
+    
     if(RCIF)/// <li> Check the @b UART reception interrupt flag, if it is set, the folowing task are executed:
     {
-        RCIF = 0;
-        if(RC1STAbits.OERR) /// <ol> <li> Check for any errors and clear them
+        if(RC1STAbits.OERR) /// <ol> <li> Check for an overrun error, clear it and count it in #uart_rx_overrun, DIAG:UART? reports it
         { 
             RC1STAbits.CREN = 0;
             RC1STAbits.CREN = 1;
-            UART_send_string((char*)"OERR_ERROR");
+            uart_rx_overrun++;
         }
         else
         {
-            UART_send_byte(command_interpreter());
+            UART_rx_isr(); /// <li> Store the received byte by calling #UART_rx_isr(), the command is executed from the main loop </ol>
         }
     }
         
+    if(TXIE && TXIF) /// <li> Check the @b UART transmission interrupt, if it is enabled and the register is free, send the next byte by calling #UART_tx_isr()
+    {
+        UART_tx_isr();
+    }
+    
+    if(ADIF) /// <li> Check the @b ADC interrupt flag, if it is set, store the conversion by calling #ADC_conversion_done()
+    {
+        ADIF = 0;
+        ADC_conversion_done();
+    }
+    
+    if(TMR2IF) /// <li> Check the @b Timer2 interrupt flag, if it is set, the acquisition is over so call #ADC_acquisition_done()
+    {
+        TMR2IF = 0;
+        ADC_acquisition_done();
+    }
+        
     if(TMR1IF) /// <li> Check the @b Timer1 interrupt flag, if it is set, the folowing task are executed:
     {
+        PROFILE_MARK(mark); /// <ol> <li> Take a time stamp before the reload. Timer1 restarted from 0x0000 at the overflow, so it is the interrupt latency
         TMR1H = 0xE1; // TMR1 clock is Fosc/4= 8Mhz (Tick= 0.125us). TMR1IF is set when the 16-bit register overflows. 7805 x 0.125us = 0.975625 ms.
-        TMR1L = 0x83;/// <ol> <li> Load the @b Timer1 16-bit register so it overflow every 0.975625 ms 
+        TMR1L = 0x83;/// <li> Load the @b Timer1 16-bit register so it overflow every 0.975625 ms 
         TMR1IF = 0; /// <li> Clear the @b Timer1 interrupt flag
+        PROFILE_ADD(PROF_LATENCY, mark); /// <li> Record the latency in the profiler
+        PROFILE_MARK(mark);
+        control_tick(); /// <li> Call the #control_tick() function, it starts the ADC sequence and runs the averages and the timing. The control law runs in the ADC interrupt when the samples are ready
+        PROFILE_RECORD(PROF_ISR, mark); /// <li> Record the duration of the Timer1 branch in the profiler
         
-        v = read_ADC(V_CHAN); /// <li> Read the ADC channel #V_CHAN and store the value in #v. Using the #read_ADC() function
-        i = read_ADC(I_CHAN); /// <li> Read the ADC channel #I_CHAN and store the value in #i. Using the #read_ADC() function
-        i = (uint16_t) (abs ( 2048 - (int)i ) ); /// <li> Substract the 2.5V bias from #i, store the absolute value in #i
-        
-        if (conv) control_loop(); /// <li> Call the #control_loop() function
-        else pidi = 0;
-        
-        calculate_avg(); /// <li> Call the #calculate_avg() function
-        timing(); /// <li> Call the #timing() function
-        
-        if (TMR1IF) UART_send_string((char*)"TIMING_ERROR"); /// <li> If the @b Timer1 interrupt flag is set, there is a timing error, print "TIMING_ERROR" into the terminal. </ol>
+        if (TMR1IF) /// <li> If the @b Timer1 interrupt flag is set, there is a timing error, count it in #timing_errors, DIAG:TIM? reports it. </ol>
+        {
+            timing_errors++;
+        }
     }
 }
\ No newline at end of file
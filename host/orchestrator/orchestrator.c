@@ -0,0 +1,647 @@
+/**
+ * @file orchestrator.c
+ * @brief Host orchestrator: drives many boards on serial ports from one thread, pipelines the SCPI lines of each
+ * board and logs their measurements in columns on disk. Usage:
+ *
+ *     orchestrator [-o dir] [-p ms] [-t s] [-c file] device...
+ *     orchestrator -r dir/bN
+ *
+ * <ol> <li> -o log directory, orch_log by default. Board N writes dir/bN, dir/devices.txt maps N to its device
+ * <li> -p period of the MEAS:ALL? polls, 1000 ms by default
+ * <li> -t stop after this many seconds, by default it runs until SIGINT or SIGTERM
+ * <li> -c setup file: command lines sent to every board before the polls. WAIT ms holds the next lines until the
+ * previous ones are answered and the time is over, e.g. while the relays switch after MODE
+ * <li> -r print the log of one board as CSV and exit </ol>
+ * The ports, a timer and the signals are waited on by one epoll. A board gets new lines while earlier ones wait for
+ * their status byte, as long as the bytes waiting fit in the reception ring of the firmware, so the slowest board
+ * never delays the others. A poll is skipped if the previous one of that board is not answered yet.
+ * Each column is a file of fixed size little endian values, named in schema.txt, one row per answered poll.
+ * At the end DIAG:UART? is asked to every board and a summary line per board is printed. The exit status is 0
+ * if no line timed out, no setup line was rejected and no port was lost. The telemetry frames must be off.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#define     ORCH_BOARDS_MAX         32 ///< Most boards of one orchestrator
+#define     ORCH_CREDIT             63 ///< Bytes of lines that may wait for their status byte: UART_RX_SIZE of the firmware less one, the ring keeps one slot free
+#define     ORCH_LINE_MAX           30 ///< Longest command line without its newline, UART_LINE_SIZE of the firmware less the newline and the terminator
+#define     ORCH_QUEUE_SIZE         64 ///< Lines waiting to be sent or answered, per board, must be a power of two
+#define     ORCH_QUEUE_MASK         (ORCH_QUEUE_SIZE - 1)
+#define     ORCH_REPLY_MAX          128 ///< Longest reply kept, the rest is dropped
+#define     ORCH_OUT_SIZE           256 ///< Bytes of lines not yet taken by the port
+#define     ORCH_TIMEOUT            2000000 ///< A line without status byte after this many us is dropped
+#define     ORCH_DRAIN              2000000 ///< us given to the last lines and DIAG:UART? at the end
+#define     ORCH_FILE_BUFFER        65536 ///< stdio buffer of each column file
+#define     ORCH_TIMER_ID           ORCH_BOARDS_MAX ///< epoll tag of the poll timer, boards use their index
+#define     ORCH_SIGNAL_ID          (ORCH_BOARDS_MAX + 1) ///< epoll tag of the signals
+
+enum { ORCH_SETUP, ORCH_POLL, ORCH_WAIT, ORCH_DIAG }; ///< Kinds of queued lines
+
+/** @brief One command line*/
+typedef struct orch_command_struct {
+    char line[ORCH_LINE_MAX + 2]; ///< The line with its newline, or the ms of a WAIT
+    uint8_t length; ///< Bytes sent
+    uint8_t kind; ///< ORCH_SETUP, ORCH_POLL, ORCH_WAIT or ORCH_DIAG
+    uint64_t sent; ///< When it was sent, us
+}orch_command_type;
+
+/** @brief Ring of command lines*/
+typedef struct orch_queue_struct {
+    orch_command_type item[ORCH_QUEUE_SIZE];
+    uint8_t head;
+    uint8_t tail;
+}orch_queue_type;
+
+/** @brief Column of the log*/
+typedef struct orch_column_struct {
+    const char* name;
+    const char* type; ///< u8, u16 or u32
+    uint8_t size;
+}orch_column_type;
+
+enum { COL_TIME, COL_LATENCY, COL_SECOND, COL_VOLTAGE, COL_CURRENT, COL_CAPACITY, COL_TEMPERATURE, COL_STATUS, COL_FAULT, ORCH_COLUMNS };
+
+static const orch_column_type       orch_columns[ORCH_COLUMNS] = {
+    { "time_ms",        "u32",  4 }, ///< When the poll was answered, since the start
+    { "latency_us",     "u32",  4 }, ///< From the poll being sent to its status byte
+    { "second",         "u16",  2 }, ///< The MEAS:ALL? fields
+    { "voltage",        "u16",  2 },
+    { "current",        "u16",  2 },
+    { "capacity",       "u16",  2 },
+    { "temperature",    "u16",  2 },
+    { "status",         "u8",   1 },
+    { "fault",          "u8",   1 },
+};
+
+/** @brief One board*/
+typedef struct orch_board_struct {
+    const char* path;
+    int fd;
+    bool dead; ///< The port failed, the board is left out
+    bool polling; ///< A MEAS:ALL? is queued or waits for its status byte
+    bool writable; ///< EPOLLOUT is requested
+    orch_queue_type queue; ///< Lines to send
+    orch_queue_type flight; ///< Lines sent, waiting for their status byte, in order
+    uint16_t credit; ///< Bytes of the lines in #flight
+    uint64_t hold; ///< No line is sent before this time, us
+    char out[ORCH_OUT_SIZE];
+    uint16_t out_length;
+    char reply[ORCH_REPLY_MAX];
+    uint16_t reply_length;
+    char diag[ORCH_REPLY_MAX]; ///< Reply of DIAG:UART?
+    FILE* column[ORCH_COLUMNS];
+    uint32_t sent;
+    uint32_t accepted;
+    uint32_t rejected;
+    uint32_t setup_rejected;
+    uint32_t timeouts;
+    uint32_t stray; ///< Status bytes with no line waiting
+    uint32_t polls;
+    uint32_t skipped;
+    uint32_t rows;
+    uint8_t depth_max; ///< Most lines waiting at once
+    uint64_t latency_sum;
+    uint64_t latency_max;
+}orch_board_type;
+
+static orch_board_type              orch_board[ORCH_BOARDS_MAX];
+static int                          orch_boards = 0;
+static int                          orch_epoll;
+static uint64_t                     orch_start;
+
+/**@brief This function returns a monotonic time in us
+*/
+static uint64_t orch_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static uint8_t orch_queue_count(const orch_queue_type* q)
+{
+    return (uint8_t) (q->head - q->tail) & ORCH_QUEUE_MASK;
+}
+
+static orch_command_type* orch_queue_put(orch_queue_type* q)
+{
+    orch_command_type*  c;
+
+    if ( orch_queue_count(q) == ORCH_QUEUE_MASK ) return NULL;
+    c = &q->item[q->head];
+    q->head = (q->head + 1) & ORCH_QUEUE_MASK;
+    return c;
+}
+
+static orch_command_type* orch_queue_peek(orch_queue_type* q)
+{
+    return q->head == q->tail ? NULL : &q->item[q->tail];
+}
+
+static void orch_queue_drop(orch_queue_type* q)
+{
+    q->tail = (q->tail + 1) & ORCH_QUEUE_MASK;
+}
+
+/**@brief This function queues a line for a board
+* @return false if the line is too long or the queue is full
+*/
+static bool orch_enqueue(orch_board_type* b, uint8_t kind, const char* line)
+{
+    size_t              length = strlen(line);
+    orch_command_type*  c;
+
+    if (length > ORCH_LINE_MAX || !(c = orch_queue_put(&b->queue)) ) return false;
+    memcpy(c->line, line, length);
+    c->line[length] = '\n';
+    c->line[length + 1] = '\0';
+    c->length = (uint8_t) (length + 1);
+    c->kind = kind;
+    if (kind == ORCH_POLL) b->polling = true;
+    return true;
+}
+
+/**@brief This function asks epoll for EPOLLOUT only while there are bytes the port did not take
+*/
+static void orch_want_write(orch_board_type* b, bool writable)
+{
+    struct epoll_event  ev;
+
+    if (b->writable == writable) return;
+    ev.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+    ev.data.u32 = (uint32_t) (b - orch_board);
+    epoll_ctl(orch_epoll, EPOLL_CTL_MOD, b->fd, &ev);
+    b->writable = writable;
+}
+
+static void orch_fail(orch_board_type* b, const char* what)
+{
+    fprintf(stderr, "board %d %s: %s\n", (int) (b - orch_board), b->path, what);
+    epoll_ctl(orch_epoll, EPOLL_CTL_DEL, b->fd, NULL);
+    b->dead = true;
+}
+
+/**@brief This function writes the pending bytes to the port, as many as it takes
+*/
+static void orch_flush(orch_board_type* b)
+{
+    ssize_t     n;
+
+    if (b->dead) return;
+    while (b->out_length)
+    {
+        n = write(b->fd, b->out, b->out_length);
+        if (n < 0)
+        {
+            if (errno == EAGAIN) break;
+            orch_fail(b, strerror(errno));
+            return;
+        }
+        memmove(b->out, b->out + n, b->out_length - (size_t) n);
+        b->out_length -= (uint16_t) n;
+    }
+    orch_want_write(b, b->out_length != 0);
+}
+
+/**@brief This function moves the queued lines of a board to the port while their bytes fit in the reception ring
+* of the board. A WAIT starts when every earlier line is answered.
+*/
+static void orch_pump(orch_board_type* b, uint64_t now)
+{
+    orch_command_type*  c;
+    orch_command_type*  f;
+    uint8_t             depth;
+
+    while (!b->dead && now >= b->hold && (c = orch_queue_peek(&b->queue)) )
+    {
+        if (c->kind == ORCH_WAIT)
+        {
+            if (orch_queue_peek(&b->flight)) break;
+            b->hold = now + strtoul(c->line, NULL, 10) * 1000;
+            orch_queue_drop(&b->queue);
+            continue;
+        }
+        if (b->credit + c->length > ORCH_CREDIT || b->out_length + c->length > ORCH_OUT_SIZE) break;
+        if ( !(f = orch_queue_put(&b->flight)) ) break;
+        memcpy(b->out + b->out_length, c->line, c->length);
+        b->out_length += c->length;
+        b->credit += c->length;
+        *f = *c;
+        f->sent = now;
+        orch_queue_drop(&b->queue);
+        b->sent++;
+        depth = orch_queue_count(&b->flight);
+        if (depth > b->depth_max) b->depth_max = depth;
+    }
+    orch_flush(b);
+}
+
+/**@brief This function writes one row of the log from a MEAS:ALL? reply, each value little endian in its column
+*/
+static void orch_log_row(orch_board_type* b, uint64_t now, uint64_t latency)
+{
+    uint32_t    row[ORCH_COLUMNS];
+    uint8_t     k;
+    uint8_t     i;
+
+    if (sscanf(b->reply, "%u,%u,%u,%u,%u,%u,%u", &row[COL_VOLTAGE], &row[COL_CURRENT], &row[COL_CAPACITY],
+        &row[COL_TEMPERATURE], &row[COL_SECOND], &row[COL_STATUS], &row[COL_FAULT]) != 7) return;
+    row[COL_TIME] = (uint32_t) ( (now - orch_start) / 1000 );
+    row[COL_LATENCY] = (uint32_t) latency;
+    for (k = 0; k < ORCH_COLUMNS; k++)
+    {
+        for (i = 0; i < orch_columns[k].size; i++) putc( (int) (row[k] >> (8 * i)) & 0xFF, b->column[k]);
+    }
+    b->rows++;
+}
+
+/**@brief This function ends the oldest line waiting for a status byte
+*/
+static void orch_complete(orch_board_type* b, uint8_t status, uint64_t now)
+{
+    orch_command_type*  c = orch_queue_peek(&b->flight);
+    uint64_t            latency;
+    size_t              length;
+
+    b->reply[b->reply_length] = '\0';
+    b->reply_length = 0;
+    if (!c)
+    {
+        b->stray++;
+        return;
+    }
+    latency = now - c->sent;
+    b->latency_sum += latency;
+    if (latency > b->latency_max) b->latency_max = latency;
+    b->credit -= c->length;
+    if (status) b->accepted++;
+    else b->rejected++;
+    switch (c->kind)
+    {
+        case ORCH_POLL:
+            b->polling = false;
+            if (status) orch_log_row(b, now, latency);
+            break;
+        case ORCH_SETUP:
+            if (!status)
+            {
+                b->setup_rejected++;
+                fprintf(stderr, "board %d %s: rejected %s", (int) (b - orch_board), b->path, c->line);
+            }
+            break;
+        case ORCH_DIAG:
+            if (!status) break;
+            length = strcspn(b->reply, "\r\n");
+            memcpy(b->diag, b->reply, length);
+            b->diag[length] = '\0';
+            break;
+    }
+    orch_queue_drop(&b->flight);
+}
+
+/**@brief This function reads what a board sent. The replies are ASCII, so a 0 or 1 byte is the status byte of
+* the oldest line waiting
+*/
+static void orch_receive(orch_board_type* b, uint64_t now)
+{
+    uint8_t     buffer[512];
+    ssize_t     n;
+    ssize_t     k;
+
+    while ( (n = read(b->fd, buffer, sizeof(buffer))) > 0 )
+    {
+        for (k = 0; k < n; k++)
+        {
+            if (buffer[k] <= 1) orch_complete(b, buffer[k], now);
+            else if (b->reply_length < ORCH_REPLY_MAX - 1) b->reply[b->reply_length++] = (char) buffer[k];
+        }
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN) ) orch_fail(b, n ? strerror(errno) : "closed");
+}
+
+/**@brief This function drops the lines that waited too long for their status byte. The status bytes may have been
+* lost, so the reply is dropped as well and the next status byte is matched to the next line sent
+*/
+static void orch_check_timeouts(orch_board_type* b, uint64_t now)
+{
+    orch_command_type*  c = orch_queue_peek(&b->flight);
+
+    if (!c || now - c->sent < ORCH_TIMEOUT) return;
+    fprintf(stderr, "board %d %s: timeout, %d lines dropped\n", (int) (b - orch_board), b->path, orch_queue_count(&b->flight));
+    while ( (c = orch_queue_peek(&b->flight)) )
+    {
+        if (c->kind == ORCH_POLL) b->polling = false;
+        b->timeouts++;
+        orch_queue_drop(&b->flight);
+    }
+    b->credit = 0;
+    b->reply_length = 0;
+}
+
+/**@brief This function opens a serial port raw at 57600 baud, non blocking
+*/
+static int orch_open_port(const char* path)
+{
+    struct termios  tio;
+    int             fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+    if (fd < 0) return -1;
+    if (tcgetattr(fd, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B57600);
+        tio.c_cflag |= CLOCAL | CREAD;
+        tcsetattr(fd, TCSANOW, &tio);
+        tcflush(fd, TCIOFLUSH);
+    }
+    return fd;
+}
+
+/**@brief This function creates the log directory of a board: schema.txt and one file per column
+*/
+static bool orch_open_log(orch_board_type* b, const char* dir, int index)
+{
+    char        path[512];
+    FILE*       schema;
+    int         k;
+
+    snprintf(path, sizeof(path), "%s/b%d", dir, index);
+    if (mkdir(path, 0777) && errno != EEXIST) return false;
+    snprintf(path, sizeof(path), "%s/b%d/schema.txt", dir, index);
+    if ( !(schema = fopen(path, "w")) ) return false;
+    for (k = 0; k < ORCH_COLUMNS; k++)
+    {
+        fprintf(schema, "%s %s\n", orch_columns[k].name, orch_columns[k].type);
+        snprintf(path, sizeof(path), "%s/b%d/%s", dir, index, orch_columns[k].name);
+        if ( !(b->column[k] = fopen(path, "wb")) ) return false;
+        setvbuf(b->column[k], NULL, _IOFBF, ORCH_FILE_BUFFER);
+    }
+    fclose(schema);
+    return true;
+}
+
+/**@brief This function queues the lines of the setup file for every board
+*/
+static bool orch_load_setup(const char* path)
+{
+    char        line[128];
+    char*       p;
+    FILE*       f = fopen(path, "r");
+    int         k;
+    bool        ok;
+
+    if (!f)
+    {
+        perror(path);
+        return false;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        for (p = line; *p == ' ' || *p == '\t'; p++);
+        if (!*p || *p == '#') continue;
+        for (k = 0; k < orch_boards; k++)
+        {
+            if (!strncasecmp(p, "WAIT ", 5)) ok = orch_enqueue(&orch_board[k], ORCH_WAIT, p + 5);
+            else ok = orch_enqueue(&orch_board[k], ORCH_SETUP, p);
+            if (!ok)
+            {
+                fprintf(stderr, "%s: line too long or too many lines: %s\n", path, p);
+                fclose(f);
+                return false;
+            }
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+/**@brief This function prints the log of one board as CSV
+*/
+static int orch_dump(const char* dir)
+{
+    char        path[512];
+    char        name[ORCH_COLUMNS][32];
+    char        type[8];
+    uint8_t     size[ORCH_COLUMNS];
+    FILE*       column[ORCH_COLUMNS];
+    FILE*       schema;
+    uint32_t    value;
+    int         columns = 0;
+    int         byte;
+    int         k;
+    int         i;
+
+    snprintf(path, sizeof(path), "%s/schema.txt", dir);
+    if ( !(schema = fopen(path, "r")) )
+    {
+        perror(path);
+        return 1;
+    }
+    while (columns < ORCH_COLUMNS && fscanf(schema, "%31s %7s", name[columns], type) == 2)
+    {
+        size[columns] = (uint8_t) (atoi(type + 1) / 8);
+        snprintf(path, sizeof(path), "%s/%s", dir, name[columns]);
+        if ( !(column[columns] = fopen(path, "rb")) )
+        {
+            perror(path);
+            return 1;
+        }
+        printf("%s%s", columns ? "," : "", name[columns]);
+        columns++;
+    }
+    fclose(schema);
+    printf("\n");
+    while (columns)
+    {
+        for (k = 0; k < columns; k++)
+        {
+            value = 0;
+            for (i = 0; i < size[k]; i++)
+            {
+                if ( (byte = getc(column[k])) == EOF ) return 0;
+                value |= (uint32_t) byte << (8 * i);
+            }
+            printf("%s%u", k ? "," : "", value);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    const char*         dir = "orch_log";
+    const char*         setup = NULL;
+    char                path[512];
+    FILE*               devices;
+    struct epoll_event  ev;
+    struct epoll_event  events[ORCH_BOARDS_MAX + 2];
+    struct itimerspec   its;
+    sigset_t            mask;
+    orch_board_type*    b;
+    uint64_t            now;
+    uint64_t            expirations;
+    uint64_t            end = 0;
+    uint64_t            drain = 0;
+    uint64_t            wake;
+    long                period = 1000;
+    double              seconds = 0;
+    bool                failed = false;
+    bool                idle;
+    int                 timer;
+    int                 sig;
+    int                 opt;
+    int                 n;
+    int                 k;
+    int                 c;
+
+    while ( (opt = getopt(argc, argv, "o:p:t:c:r:")) != -1 )
+    {
+        switch (opt)
+        {
+            case 'o': dir = optarg; break;
+            case 'p': period = atol(optarg); break;
+            case 't': seconds = atof(optarg); break;
+            case 'c': setup = optarg; break;
+            case 'r': return orch_dump(optarg);
+            default:
+                fprintf(stderr, "usage: %s [-o dir] [-p ms] [-t s] [-c file] device...\n       %s -r dir/bN\n", argv[0], argv[0]);
+                return 2;
+        }
+    }
+    if (optind == argc || argc - optind > ORCH_BOARDS_MAX || period <= 0)
+    {
+        fprintf(stderr, "%s: from 1 to %d devices and a positive period\n", argv[0], ORCH_BOARDS_MAX);
+        return 2;
+    }
+    if (mkdir(dir, 0777) && errno != EEXIST)
+    {
+        perror(dir);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/devices.txt", dir);
+    if ( !(devices = fopen(path, "w")) )
+    {
+        perror(path);
+        return 1;
+    }
+    orch_epoll = epoll_create1(0);
+    for (k = optind; k < argc; k++) /// * Open every port and its log and add it to the epoll
+    {
+        b = &orch_board[orch_boards];
+        b->path = argv[k];
+        b->fd = orch_open_port(b->path);
+        if (b->fd < 0 || !orch_open_log(b, dir, orch_boards))
+        {
+            perror(b->path);
+            return 1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t) orch_boards;
+        epoll_ctl(orch_epoll, EPOLL_CTL_ADD, b->fd, &ev);
+        fprintf(devices, "b%d %s\n", orch_boards, b->path);
+        orch_boards++;
+    }
+    fclose(devices);
+    if (setup && !orch_load_setup(setup)) return 1; /// * Queue the setup lines of every board
+    sigemptyset(&mask); /// * Take SIGINT and SIGTERM through the epoll, so the logs are closed
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sig = signalfd(-1, &mask, SFD_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u32 = ORCH_SIGNAL_ID;
+    epoll_ctl(orch_epoll, EPOLL_CTL_ADD, sig, &ev);
+    timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK); /// * The poll timer also checks the timeouts
+    its.it_value.tv_sec = its.it_interval.tv_sec = period / 1000;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = period % 1000 * 1000000;
+    timerfd_settime(timer, 0, &its, NULL);
+    ev.data.u32 = ORCH_TIMER_ID;
+    epoll_ctl(orch_epoll, EPOLL_CTL_ADD, timer, &ev);
+
+    orch_start = orch_now();
+    if (seconds > 0) end = orch_start + (uint64_t) (seconds * 1e6);
+    while (1)
+    {
+        now = orch_now();
+        if (!drain && end && now >= end) drain = 1;
+        if (drain == 1) /// * At the end, ask DIAG:UART? and give the lines waiting some time to be answered
+        {
+            drain = now + ORCH_DRAIN;
+            for (k = 0; k < orch_boards; k++) orch_enqueue(&orch_board[k], ORCH_DIAG, "DIAG:UART?");
+        }
+        wake = drain ? drain : UINT64_MAX;
+        idle = true;
+        for (k = 0; k < orch_boards; k++)
+        {
+            b = &orch_board[k];
+            orch_pump(b, now);
+            if (!b->dead && (orch_queue_peek(&b->queue) || orch_queue_peek(&b->flight) || b->out_length)) idle = false;
+            if (!b->dead && b->hold > now && orch_queue_peek(&b->queue) && b->hold < wake) wake = b->hold;
+        }
+        if (drain && (idle || now >= drain)) break;
+        n = epoll_wait(orch_epoll, events, ORCH_BOARDS_MAX + 2, wake == UINT64_MAX ? -1 : (int) ( (wake - now + 999) / 1000 ));
+        if (n < 0 && errno != EINTR) break;
+        now = orch_now();
+        for (c = 0; c < n; c++)
+        {
+            if (events[c].data.u32 == ORCH_SIGNAL_ID) /// * A signal ends the run
+            {
+                struct signalfd_siginfo si;
+
+                while (read(sig, &si, sizeof(si)) > 0);
+                if (!drain) drain = 1;
+            }else if (events[c].data.u32 == ORCH_TIMER_ID) /// * Every period, poll the boards that answered their last poll
+            {
+                while (read(timer, &expirations, sizeof(expirations)) > 0);
+                for (k = 0; k < orch_boards; k++)
+                {
+                    b = &orch_board[k];
+                    if (b->dead) continue;
+                    orch_check_timeouts(b, now);
+                    if (drain) continue;
+                    if (b->polling) b->skipped++;
+                    else if (orch_enqueue(b, ORCH_POLL, "MEAS:ALL?")) b->polls++;
+                }
+            }else
+            {
+                b = &orch_board[events[c].data.u32];
+                if (b->dead) continue;
+                if (events[c].events & EPOLLIN) orch_receive(b, now);
+                if (!b->dead && (events[c].events & EPOLLOUT)) orch_flush(b);
+                if (!b->dead && (events[c].events & (EPOLLERR | EPOLLHUP)) && !(events[c].events & EPOLLIN)) orch_fail(b, "hang-up");
+            }
+        }
+    }
+
+    for (k = 0; k < orch_boards; k++) /// * Close the logs and print one summary line per board
+    {
+        b = &orch_board[k];
+        for (c = 0; c < ORCH_COLUMNS; c++) fclose(b->column[c]);
+        failed |= b->dead || b->timeouts || b->setup_rejected;
+        printf("board=%d device=%s sent=%u accepted=%u rejected=%u setup_rejected=%u timeouts=%u stray=%u polls=%u skipped=%u "
+            "rows=%u depth_max=%u latency_avg_ms=%.1f latency_max_ms=%.1f uart=%s%s\n",
+            k, b->path, b->sent, b->accepted, b->rejected, b->setup_rejected, b->timeouts, b->stray, b->polls, b->skipped,
+            b->rows, b->depth_max, b->accepted + b->rejected ? b->latency_sum / 1000.0 / (b->accepted + b->rejected) : 0,
+            b->latency_max / 1000.0, b->diag[0] ? b->diag : "-", b->dead ? " lost" : "");
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,184 @@
+/**
+ * @file board.c
+ * @brief Host model of one board. On every Timer1 period #board_tick:
+ * <ol> <li> Integrates the plant with the present duty cycle and relays
+ * <li> Raises TMR1IF and calls the ISR of main.c, then completes the ADC conversions and the Timer2
+ * acquisition times it starts, each one through the ISR as on the PIC
+ * <li> Moves the UART bytes the baud rate allows in each direction, through the ISR
+ * <li> Runs the main loop tasks with #task_run </ol>
+ * The ISR can not preempt the main loop on the host. When #UART_wait_tx waits for the transmission buffer,
+ * its CLRWDT() calls #board_idle, which sends the bytes through the TX interrupt without advancing the time.
+ */
+
+#include <string.h>
+#include "board.h"
+#include "charger_discharger.h"
+
+void ISR(void); /// Interrupt service routine of main.c
+
+plant_type                          board_plant;
+board_fifo_type                     board_rx;
+board_fifo_type                     board_tx;
+uint32_t                            board_ticks = 0;
+static double                       board_rx_credit = 0; ///< Bytes the UART can receive, it grows with the baud rate
+static double                       board_tx_credit = 0; ///< Bytes the UART can send
+
+/**@brief This function lets the plant see the relay pins during the __delay_ms() of a relay pulse
+*/
+static void board_delay(unsigned ms)
+{
+    plant_relays(&board_plant, RC3, RC4, RC5, (uint8_t) (RB2 | RB3 << 1 | RB4 << 2 | RB5 << 3));
+}
+
+/**@brief This function sends one byte through the TX interrupt, it is called by the busy waits of the firmware
+*/
+static void board_idle()
+{
+    if (!TXIE) return;
+    TXIF = 1;
+    ISR();
+    TXIF = 0;
+    board_fifo_put(&board_tx, TX1REG);
+}
+
+/**@brief This function starts the firmware as after a reset, with the plant defaults of #plant_init
+*/
+void board_init()
+{
+    plant_init(&board_plant);
+    xc_stub_delay = board_delay;
+    initialize();
+    interrupt_enable();
+    xc_stub_idle = board_idle;
+    board_ticks = 0;
+}
+
+bool board_fifo_put(board_fifo_type* f, uint8_t byte)
+{
+    uint16_t    next = (f->head + 1) % BOARD_FIFO_SIZE;
+
+    if (next == f->tail) return false;
+    f->data[f->head] = byte;
+    f->head = next;
+    return true;
+}
+
+bool board_fifo_get(board_fifo_type* f, uint8_t* byte)
+{
+    if (f->tail == f->head) return false;
+    *byte = f->data[f->tail];
+    f->tail = (f->tail + 1) % BOARD_FIFO_SIZE;
+    return true;
+}
+
+/**@brief This function queues @p text to be received by the board
+*/
+void board_write(const char* text)
+{
+    while (*text) board_fifo_put(&board_rx, (uint8_t) *text++);
+}
+
+/**@brief This function completes the ADC conversions and acquisition times started by the ISR
+*/
+static void board_adc()
+{
+    uint16_t    value;
+    uint8_t     k;
+
+    for (k = 0; k < 2 * ADC_SEQ_MAX; k++)
+    {
+        if (GO_nDONE) /// The conversion of the selected channel is done
+        {
+            value = plant_adc(&board_plant, ADCON0bits.CHS);
+            ADRESH = (uint8_t) (value >> 8);
+            ADRESL = (uint8_t) value;
+            GO_nDONE = 0;
+            ADIF = 1;
+            ISR();
+        }
+        else if (TMR2ON) /// The acquisition time is over
+        {
+            TMR2IF = 1;
+            ISR();
+        }
+        else return;
+    }
+}
+
+/**@brief This function moves the UART bytes of one Timer1 period
+*/
+static void board_uart()
+{
+    uint8_t     byte;
+
+    board_rx_credit += BOARD_BYTES_PER_TICK;
+    while (board_rx_credit >= 1 && board_fifo_get(&board_rx, &byte))
+    {
+        board_rx_credit -= 1;
+        RC1REG = byte;
+        RCIF = 1;
+        ISR();
+        RCIF = 0;
+    }
+    if (board_rx_credit > 1) board_rx_credit = 1;
+    board_tx_credit += BOARD_BYTES_PER_TICK;
+    while (board_tx_credit >= 1 && TXIE)
+    {
+        board_tx_credit -= 1;
+        TXIF = 1;
+        ISR();
+        TXIF = 0;
+        board_fifo_put(&board_tx, TX1REG);
+    }
+    if (board_tx_credit > 1) board_tx_credit = 1;
+}
+
+/**@brief This function advances the board by one Timer1 period
+*/
+void board_tick()
+{
+    uint8_t     k;
+
+    plant_relays(&board_plant, RC3, RC4, RC5, (uint8_t) (RB2 | RB3 << 1 | RB4 << 2 | RB5 << 3));
+    plant_step(&board_plant, (uint16_t) ( PSMC1DCL | (PSMC1DCH & 0x01) << 8 ), BOARD_TICK);
+    TMR1IF = 1;
+    ISR();
+    board_adc();
+    board_uart();
+    for (k = 0; k < TASKS; k++) task_run(); /// The main loop spins many times per period on the PIC
+    board_ticks++;
+}
+
+void board_run(uint32_t ticks)
+{
+    while (ticks--) board_tick();
+}
+
+/**@brief This function sends @p line with its newline and runs the board until the status byte comes back
+* @param reply where the text sent before the status byte is stored, null terminated
+* @return the status byte, 1 if the command was executed, 0 if not, or -1 on timeout
+*/
+int board_command(const char* line, char* reply, size_t size)
+{
+    size_t      n = 0;
+    uint32_t    k;
+    uint8_t     byte;
+
+    board_write(line);
+    board_write("\n");
+    for (k = 0; k < BOARD_TIMEOUT; k++)
+    {
+        board_tick();
+        while (board_fifo_get(&board_tx, &byte))
+        {
+            if (byte == 0 || byte == 1) /// Replies are ASCII, so a 0 or 1 byte is the status
+            {
+                if (reply && size) reply[n < size ? n : size - 1] = 0;
+                return byte;
+            }
+            if (reply && n + 1 < size) reply[n++] = (char) byte;
+        }
+    }
+    if (reply && size) reply[n < size ? n : size - 1] = 0;
+    return -1;
+}
@@ -0,0 +1,38 @@
+/**
+ * @file board.h
+ * @brief Host model of one board: the firmware, its peripherals and the plant, advanced one Timer1 period at a time.
+ */
+#ifndef BOARD_H
+#define BOARD_H
+
+    #include <stdint.h>
+    #include <stdbool.h>
+    #include <stddef.h>
+    #include "plant.h"
+
+    #define     BOARD_TICK              0.000975625 ///< Timer1 period, s
+    #define     BOARD_BYTES_PER_TICK    (57600.0 / 10 * BOARD_TICK) ///< UART bytes per Timer1 period at 57600 baud, 8N1
+    #define     BOARD_FIFO_SIZE         4096 ///< Size of the UART byte queues of the host side
+    #define     BOARD_TIMEOUT           2000 ///< Control cycles #board_command waits for the status byte
+
+    /** @brief Byte queue between the host and the emulated UART*/
+    typedef struct board_fifo_struct {
+        uint8_t data[BOARD_FIFO_SIZE];
+        uint16_t head;
+        uint16_t tail;
+    }board_fifo_type;
+
+    extern plant_type                   board_plant; ///< Plant connected to the board
+    extern board_fifo_type              board_rx; ///< Bytes waiting to be received by the board
+    extern board_fifo_type              board_tx; ///< Bytes sent by the board
+    extern uint32_t                     board_ticks; ///< Control cycles since #board_init
+
+    void board_init(void);
+    void board_tick(void);
+    void board_run(uint32_t ticks);
+    bool board_fifo_put(board_fifo_type* f, uint8_t byte);
+    bool board_fifo_get(board_fifo_type* f, uint8_t* byte);
+    void board_write(const char* text);
+    int board_command(const char* line, char* reply, size_t size);
+
+#endif /* BOARD_H */
@@ -0,0 +1,146 @@
+/**
+ * @file emulator.c
+ * @brief Board emulator on a pseudo terminal: the firmware and the plant of board.c behind a pty, so host
+ * software can be run against it as against a board on a serial port. Usage:
+ *
+ *     emulator [-x speed] [-s soc] [-l link]
+ *
+ * <ol> <li> -x how many times faster than real time the board runs, 1 by default
+ * <li> -s initial state of charge of the cell in %, 50 by default
+ * <li> -l also make a symbolic link @p link to the pty </ol>
+ * The pty name is printed on the first line of the output. The UART moves 57600 baud of board time, so at
+ * -x 10 a host sees ten times the baud rate. It runs until it gets SIGINT or SIGTERM.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include "board.h"
+
+static volatile sig_atomic_t        emulator_stop = 0;
+
+static void emulator_signal(int sig)
+{
+    emulator_stop = 1;
+}
+
+/**@brief This function returns a monotonic time in seconds
+*/
+static double emulator_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**@brief This function opens the pty and sets its slave side raw, so nothing is echoed or translated
+* @return the master file descriptor, the slave one is kept open in @p slave so the master does not see a hang-up
+*/
+static int emulator_open(int* slave, char* name, size_t size)
+{
+    struct termios  tio;
+    int             master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (master < 0 || grantpt(master) || unlockpt(master) || ptsname_r(master, name, size)) return -1;
+    *slave = open(name, O_RDWR | O_NOCTTY);
+    if (*slave < 0 || tcgetattr(*slave, &tio)) return -1;
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B57600);
+    if (tcsetattr(*slave, TCSANOW, &tio)) return -1;
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    return master;
+}
+
+int main(int argc, char** argv)
+{
+    char            name[128];
+    const char*     link_name = NULL;
+    double          speed = 1;
+    double          soc = 50;
+    double          start;
+    double          due;
+    uint8_t         buffer[256];
+    struct pollfd   pfd;
+    ssize_t         n;
+    size_t          pending = 0;
+    int             slave;
+    int             master;
+    int             opt;
+    int             k;
+
+    while ( (opt = getopt(argc, argv, "x:s:l:")) != -1 )
+    {
+        switch (opt)
+        {
+            case 'x': speed = atof(optarg); break;
+            case 's': soc = atof(optarg); break;
+            case 'l': link_name = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-x speed] [-s soc] [-l link]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (speed <= 0) speed = 1;
+    master = emulator_open(&slave, name, sizeof(name));
+    if (master < 0)
+    {
+        perror("pty");
+        return 1;
+    }
+    if (link_name)
+    {
+        unlink(link_name);
+        if (symlink(name, link_name))
+        {
+            perror(link_name);
+            return 1;
+        }
+    }
+    signal(SIGINT, emulator_signal);
+    signal(SIGTERM, emulator_signal);
+    printf("%s\n", name);
+    fflush(stdout);
+
+    board_init();
+    board_plant.soc = soc / 100;
+    start = emulator_now();
+    pfd.fd = master;
+    pfd.events = POLLIN;
+    while (!emulator_stop)
+    {
+        due = start + (board_ticks + 1) * BOARD_TICK / speed; /// * Wait for the next tick, or for bytes from the host
+        k = (int) ( (due - emulator_now()) * 1000 );
+        if (poll(&pfd, 1, k > 0 ? k : 0) > 0 && (pfd.revents & POLLIN))
+        {
+            while ( (n = read(master, buffer, sizeof(buffer))) > 0 ) /// * Queue the received bytes for the UART of the board
+            {
+                for (k = 0; k < n; k++) board_fifo_put(&board_rx, buffer[k]);
+            }
+        }
+        while (board_ticks * BOARD_TICK / speed < emulator_now() - start) board_tick(); /// * Run the ticks that are due
+        while (pending < sizeof(buffer) && board_fifo_get(&board_tx, &buffer[pending])) pending++; /// * Send what the board sent
+        if (pending)
+        {
+            n = write(master, buffer, pending);
+            if (n > 0)
+            {
+                memmove(buffer, buffer + n, pending - (size_t) n);
+                pending -= (size_t) n;
+            }
+            else if (n < 0 && errno != EAGAIN) break;
+        }
+    }
+    if (link_name) unlink(link_name);
+    close(master);
+    close(slave);
+    return 0;
+}
@@ -0,0 +1,117 @@
+/**
+ * @file plant.c
+ * @brief Averaged model of the power stage and of a Li-ion cell.
+ * <ol> <li> Charging, the stage is a buck from #plant_struct::vbus_charge: L di/dt = D Vbus - Vcell - i R
+ * <li> Discharging, it is a boost into #plant_struct::vbus_discharge: L di/dt = (1 - D) Vbus - Vcell - i R
+ * <li> The current can not reverse, as with the diodes of a non-synchronous stage
+ * <li> The cell is an open circuit voltage by state of charge, a series resistance and one RC pair </ol>
+ */
+
+#include <math.h>
+#include "plant.h"
+#include "charger_discharger.h"
+
+/**@brief This function loads the default parameters: a 2 Ah cell at 50% and a 100 uH stage
+*/
+void plant_init(plant_type* p)
+{
+    static const double ocv[PLANT_OCV_POINTS] = { 3.00, 3.45, 3.55, 3.62, 3.68, 3.74, 3.81, 3.89, 3.97, 4.07, 4.20 };
+    uint8_t     k;
+
+    p->vbus_charge = 8.0;
+    p->vbus_discharge = 6.0;
+    p->inductance = 100e-6;
+    p->r_path = 0.08;
+    p->capacity = 2.0 * 3600;
+    p->r0 = 0.05;
+    p->r1 = 0.03;
+    p->c1 = 1000;
+    p->temperature = 25;
+    p->noise = 1;
+    for (k = 0; k < PLANT_OCV_POINTS; k++) p->ocv[k] = ocv[k];
+    p->soc = 0.5;
+    p->v1 = 0;
+    p->il = 0;
+    p->charge = 0;
+    p->discharge = 1;
+    p->cell = 0;
+    p->connected = 0;
+    p->seed = 1;
+}
+
+/**@brief This function follows the relay pins. RC3 and RC4 pulse the latching mode relay, RC5 is the main relay
+* and @p cells holds RB2 to RB5
+*/
+void plant_relays(plant_type* p, bool rc3, bool rc4, bool rc5, uint8_t cells)
+{
+    if (rc3) p->discharge = 1;
+    if (rc4) p->discharge = 0;
+    p->cell = cells != 0;
+    p->connected = rc5 && p->cell;
+    if (!p->connected) p->il = 0;
+}
+
+/**@brief This function returns the open circuit voltage, interpolated in the table
+*/
+static double plant_ocv(const plant_type* p)
+{
+    double      x = p->soc * (PLANT_OCV_POINTS - 1);
+    int         k;
+
+    if (x <= 0) return p->ocv[0] + x * (p->ocv[1] - p->ocv[0]);
+    if (x >= PLANT_OCV_POINTS - 1) return p->ocv[PLANT_OCV_POINTS - 1];
+    k = (int) x;
+    return p->ocv[k] + (x - k) * (p->ocv[k + 1] - p->ocv[k]);
+}
+
+/**@brief This function integrates the model over @p dt seconds with the 9-bit @p duty
+*/
+void plant_step(plant_type* p, uint16_t duty, double dt)
+{
+    double      d = duty / 512.0;
+    double      h = dt / PLANT_SUBSTEPS;
+    double      drive;
+    uint8_t     k;
+
+    for (k = 0; k < PLANT_SUBSTEPS; k++)
+    {
+        if (p->connected)
+        {
+            drive = p->discharge ? (1 - d) * p->vbus_discharge : d * p->vbus_charge;
+            p->il += h * (drive - plant_ocv(p) - p->v1 - p->il * (p->r0 + p->r_path)) / p->inductance;
+            if (p->discharge && p->il > 0) p->il = 0;
+            if (!p->discharge && p->il < 0) p->il = 0;
+        }
+        p->v1 += h * (p->il / p->c1 - p->v1 / (p->r1 * p->c1));
+        p->soc += h * p->il / p->capacity;
+        p->charge += h * p->il;
+    }
+}
+
+/**@brief This function returns the voltage at the cell terminals, where it is sensed
+*/
+double plant_voltage(const plant_type* p)
+{
+    return plant_ocv(p) + p->v1 + p->il * p->r0;
+}
+
+/**@brief This function returns what the ADC reads on @p channel, with the nominal gains of the board
+*/
+uint16_t plant_adc(plant_type* p, uint8_t channel)
+{
+    double      mv;
+    int32_t     counts;
+
+    switch (channel)
+    {
+        case V_CHAN: mv = plant_voltage(p) * 1000; break; /// The divider is across the cell, before the relays
+        case I_CHAN: mv = 2500 + p->il * 400; break; /// 0.4 V/A around the 2.5 V bias
+        case T_CHAN: mv = p->temperature * 10; break; /// 10 mV per degree
+        default: mv = 600; break;
+    }
+    p->seed = p->seed * 1103515245u + 12345u; /// Uniform noise of +-#plant_struct::noise counts
+    counts = (int32_t) floor(mv * 4096 / 5000 + 0.5 + p->noise * ( (double) (p->seed >> 16 & 0x7FFF) / 16384.0 - 1 ));
+    if (counts < 0) counts = 0;
+    if (counts > ADC_MAX) counts = ADC_MAX;
+    return (uint16_t) counts;
+}
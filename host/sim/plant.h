@@ -0,0 +1,44 @@
+/**
+ * @file plant.h
+ * @brief Averaged model of the power stage and of a Li-ion cell, driven by the PSMC duty cycle and
+ * the relay pins of the firmware, and read back through the ADC channels.
+ */
+#ifndef PLANT_H
+#define PLANT_H
+
+    #include <stdint.h>
+    #include <stdbool.h>
+
+    #define     PLANT_OCV_POINTS        11 ///< Points of the open circuit voltage table, from 0% to 100% state of charge
+    #define     PLANT_SUBSTEPS          8 ///< Integration steps per control cycle
+
+    /** @brief Parameters and state of the power stage and the cell*/
+    typedef struct plant_struct {
+        double vbus_charge; ///< Source of the buck when charging, V
+        double vbus_discharge; ///< Bus fed by the boost when discharging, V
+        double inductance; ///< Inductance of the power stage, H
+        double r_path; ///< Resistance of the inductor, switches and wiring, ohm
+        double capacity; ///< Cell capacity, As
+        double r0; ///< Ohmic resistance of the cell, ohm
+        double r1; ///< Polarization resistance of the cell, ohm
+        double c1; ///< Polarization capacitance of the cell, F
+        double temperature; ///< Cell temperature, degrees C
+        double noise; ///< Peak ADC noise, counts
+        double ocv[PLANT_OCV_POINTS]; ///< Open circuit voltage, V
+        double soc; ///< State of charge, 0 to 1
+        double v1; ///< Voltage of the polarization RC pair, V
+        double il; ///< Inductor current, A, positive into the cell
+        double charge; ///< Charge into the cell since #plant_init, As
+        bool discharge; ///< Direction latched by the mode relays
+        bool cell; ///< A cell relay is closed
+        bool connected; ///< A cell and the main relay are closed, so current can flow
+        uint32_t seed; ///< State of the noise generator
+    }plant_type;
+
+    void plant_init(plant_type* p);
+    void plant_relays(plant_type* p, bool rc3, bool rc4, bool rc5, uint8_t cells);
+    void plant_step(plant_type* p, uint16_t duty, double dt);
+    double plant_voltage(const plant_type* p);
+    uint16_t plant_adc(plant_type* p, uint8_t channel);
+
+#endif /* PLANT_H */
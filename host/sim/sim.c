@@ -0,0 +1,168 @@
+/**
+ * @file sim.c
+ * @brief Closed-loop simulator: runs the firmware against the plant model through its SCPI commands and
+ * reports how the loop behaved. Usage:
+ *
+ *     sim [-m charge|discharge|cycle] [-c mA] [-v mV] [-e mA] [-d mV] [-a mAh] [-s %] [-b mV] [-q]
+ *
+ * <ol> <li> -m what to run, charge by default. cycle is a charge and then a discharge
+ * <li> -c current setpoint (1000 mA), -v CV voltage (4200 mV), -e end of charge current (100 mA),
+ * -d end of discharge voltage (3000 mV)
+ * <li> -a cell capacity (2000 mAh), -s initial state of charge, 20% by default or 100% for a discharge
+ * <li> -b FEED:BUS, 0 by default
+ * <li> -q only the result lines </ol>
+ * Every run prints one line of key=value pairs: the settling time and overshoot of the average current after the start,
+ * when CV was reached, the test time, the capacity counted by the firmware and by the plant, and the end cause.
+ * The exit status is 0 if every run reached its end limit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "board.h"
+#include "charger_discharger.h"
+
+#define     SIM_BAND                0.02 ///< The current is settled within 2% of the setpoint
+#define     SIM_SETTLE_WINDOW       30750 ///< The settling and the overshoot are measured in the first 30 s
+#define     SIM_AVERAGE             16 ///< Cycles of the average of the current, as the duty dithers over 16 cycles
+#define     SIM_MAX_TICKS           (12UL * 3600 * 1025) ///< Longest run, 12 h
+
+static int                          sim_current = 1000;
+static int                          sim_voltage = 4200;
+static int                          sim_endc = 100;
+static int                          sim_endd = 3000;
+static int                          sim_bus = 0;
+static bool                         sim_quiet = 0;
+
+/**@brief This function sends a command and stops the simulation if it is not accepted
+*/
+static void sim_command(const char* line)
+{
+    char        reply[64];
+    int         status = board_command(line, reply, sizeof(reply));
+
+    if (!sim_quiet) printf("> %s -> %d %s", line, status, reply);
+    if (!sim_quiet && !strchr(reply, '\n')) printf("\n");
+    if (status != 1)
+    {
+        fprintf(stderr, "command not accepted: %s\n", line);
+        exit(2);
+    }
+}
+
+/**@brief This function sends a command until the relays let it run
+*/
+static void sim_command_retry(const char* line)
+{
+    int         k;
+
+    for (k = 0; k < 50; k++)
+    {
+        if (board_command(line, NULL, 0) == 1)
+        {
+            if (!sim_quiet) printf("> %s -> 1\n", line);
+            return;
+        }
+        board_run(20);
+    }
+    sim_command(line);
+}
+
+/**@brief This function runs one charge or discharge to its end limit and prints the result line
+* @return true if the end limit was reached
+*/
+static bool sim_run(bool discharge)
+{
+    char        line[32];
+    double      set = sim_current / 1000.0;
+    double      current = 0;
+    double      peak = 0;
+    double      charge0 = board_plant.charge;
+    uint32_t    start = 0;
+    uint32_t    settled = 0;
+    uint32_t    cv = 0;
+    uint32_t    k;
+    clock_t     wall = clock();
+    double      seconds;
+
+    sim_command(discharge ? "MODE:DISC" : "MODE:CHAR");
+    snprintf(line, sizeof(line), "CURR %d", sim_current);
+    sim_command(line);
+    if (discharge)
+    {
+        snprintf(line, sizeof(line), "VOLT:ENDD %d", sim_endd);
+        sim_command(line);
+    }else
+    {
+        snprintf(line, sizeof(line), "VOLT %d", sim_voltage);
+        sim_command(line);
+        snprintf(line, sizeof(line), "CURR:ENDC %d", sim_endc);
+        sim_command(line);
+    }
+    snprintf(line, sizeof(line), "FEED:BUS %d", sim_bus);
+    sim_command(line);
+    sim_command_retry("OUTP:START");
+    for (k = 0; k < SIM_MAX_TICKS; k++)
+    {
+        board_tick();
+        if (!start)
+        {
+            if (ctrl.conv) start = board_ticks;
+            continue;
+        }
+        if (!ctrl.conv) break;
+        current += (fabs(board_plant.il) - current) / SIM_AVERAGE; /// One step of the duty moves the current more than the band, so the average is measured
+        if (board_ticks - start < SIM_SETTLE_WINDOW)
+        {
+            if (current > peak) peak = current;
+            if (fabs(current - set) > SIM_BAND * set) settled = board_ticks - start + 1;
+        }
+        if (!cv && !ctrl.cmode) cv = board_ticks - start;
+    }
+    seconds = (board_ticks - start) * BOARD_TICK;
+    printf("mode=%s settling_ms=%.1f overshoot_pct=%.1f cv_s=%.1f time_s=%.1f capacity_mAh=%u plant_mAh=%.1f end=%u speedup=%.0f\n",
+        discharge ? "discharge" : "charge", settled * BOARD_TICK * 1000, peak > set ? (peak - set) / set * 100 : 0,
+        cv * BOARD_TICK, seconds, log_data.capacity, fabs(board_plant.charge - charge0) / 3.6, end_cause,
+        seconds / ( (double) (clock() - wall) / CLOCKS_PER_SEC + 1e-9 ));
+    return end_cause == END_LIMIT;
+}
+
+int main(int argc, char** argv)
+{
+    const char* mode = "charge";
+    double      soc = -1;
+    bool        ok = 1;
+    int         opt;
+
+    board_init();
+    while ( (opt = getopt(argc, argv, "m:c:v:e:d:a:s:b:q")) != -1 )
+    {
+        switch (opt)
+        {
+            case 'm': mode = optarg; break;
+            case 'c': sim_current = atoi(optarg); break;
+            case 'v': sim_voltage = atoi(optarg); break;
+            case 'e': sim_endc = atoi(optarg); break;
+            case 'd': sim_endd = atoi(optarg); break;
+            case 'a': board_plant.capacity = atof(optarg) * 3.6; break;
+            case 's': soc = atof(optarg) / 100; break;
+            case 'b': sim_bus = atoi(optarg); break;
+            case 'q': sim_quiet = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-m charge|discharge|cycle] [-c mA] [-v mV] [-e mA] [-d mV] [-a mAh] [-s %%] [-b mV] [-q]\n", argv[0]);
+                return 2;
+        }
+    }
+    board_plant.soc = soc >= 0 ? soc : (strcmp(mode, "discharge") ? 0.2 : 1.0);
+    board_run(100); /// Let the filters and the relays of the reset settle
+    if (!strcmp(mode, "charge") || !strcmp(mode, "cycle")) ok &= sim_run(0);
+    if (!strcmp(mode, "discharge") || !strcmp(mode, "cycle"))
+    {
+        board_run(1025); /// One second of rest
+        ok &= sim_run(1);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file xc.h
+ * @brief Host stand-in for the XC8 device header, used by the simulator and the unit tests in host/.
+ * Every special function register or bit used by the firmware is a plain 8-bit variable defined in
+ * xc_stub.c, so the firmware compiles unchanged with a host compiler. The simulator moves the
+ * registers the way the PIC16F1786 peripherals would, see sim/sim.c.
+ */
+#ifndef XC_STUB_H
+#define XC_STUB_H
+
+    #include <stdint.h>
+    #include <stddef.h>
+    
+    typedef uint32_t    uint24_t; ///< XC8 24-bit integer, 32 bits on the host
+    typedef int32_t     int24_t;
+    
+    #define     __interrupt(...)
+    #define     __bank(n) ///< The host has a flat memory
+    #define     __delay_ms(x)           do { if (xc_stub_delay) xc_stub_delay(x); } while (0) ///< The relays are pulsed between delays, the simulator samples them there
+    #define     __delay_us(x)           ((void) 0)
+    #define     CLRWDT()                do { if (xc_stub_idle) xc_stub_idle(); } while (0) ///< The busy waits of the firmware clear the watchdog, the host serves the interrupts there
+    
+    extern void                         (*xc_stub_delay)(unsigned ms); ///< Called by __delay_ms(), set by the simulator
+    extern void                         (*xc_stub_idle)(void); ///< Called by CLRWDT(), set by the simulator
+    #define     NOP()                   ((void) 0)
+    
+    /** Registers and bits used by the firmware, expanded with @p R*/
+    #define     XC_STUB_REGISTERS(R) \
+    R(nWPUEN) R(WPUE3) R(TRISC3) R(WPUC3) R(TRISC4) R(WPUC4) \
+    R(TRISC5) R(WPUC5) R(TRISB2) R(ANSB2) R(WPUB2) R(TRISB3) \
+    R(ANSB3) R(WPUB3) R(TRISB4) R(ANSB4) R(WPUB4) R(TRISB5) \
+    R(ANSB5) R(WPUB5) R(nT1SYNC) R(T1OSCEN) R(TMR1ON) R(TMR1GE) \
+    R(TMR1CS0) R(TMR1CS1) R(T1CKPS0) R(T1CKPS1) R(TMR1H) R(TMR1L) \
+    R(PSMC1CON) R(PSMC1MDL) R(PSMC1CLK) R(PSMC1PRH) R(PSMC1PRL) R(PSMC1DCH) \
+    R(PSMC1DCL) R(PSMC1PHH) R(PSMC1PHL) R(P1STRC) R(P1POLC) R(P1OEC) \
+    R(P1PRST) R(P1PHST) R(P1DCST) R(TRISC2) R(WPUC2) R(TRISA3) \
+    R(ANSA3) R(WPUA3) R(TRISB1) R(ANSB1) R(WPUB1) R(TRISB0) \
+    R(ANSB0) R(WPUB0) R(TRISA5) R(ANSA5) R(WPUA5) R(TXSEL) \
+    R(RXSEL) R(SP1BRGH) R(SP1BRGL) R(BRGH) R(BRG16) R(SYNC) \
+    R(SPEN) R(TXEN) R(CREN) R(TX9) R(RX9) R(RCIE) \
+    R(TXIE) R(RCIF) R(TXIF) R(TMR1IE) R(TMR1IF) R(PEIE) \
+    R(GIE) R(RC1REG) R(TX1REG) R(OERR) R(FERR) R(ADRESL) \
+    R(ADRESH) R(GO_nDONE) R(RB2) R(RB3) R(RB4) R(RB5) \
+    R(RC3) R(RC4) R(RC5) R(ADIE) R(ADIF) R(EEADRL) \
+    R(EEADRH) R(EEDATL) R(EEDATH) R(CFGS) R(EEPGD) R(WREN) \
+    R(WR) R(RD) R(TMR2) R(TMR2IF) R(TMR2IE) R(T2CON) \
+    R(PR2) R(TMR0) R(TMR0IF) R(C1IF) R(C1IE) R(TMR2ON) \
+    R(TSEN) R(TSRNG)
+    
+    #define     XC_STUB_DECLARE(name)   extern volatile uint8_t name;
+    XC_STUB_REGISTERS(XC_STUB_DECLARE)
+    
+    /** @brief Bit fields of the registers accessed as @p REGbits.FIELD*/
+    typedef struct xc_stub_bits_struct {
+        unsigned IRCF:4, SCS:2, SPLLEN:1; ///< OSCCON
+        unsigned ADON:1, CHS:5, ADRMD:1, ADCS:3, ADNREF:1, ADPREF:2, ADFM:1, CHSN:4; ///< ADCON0, ADCON1, ADCON2
+        unsigned OERR:1, CREN:1; ///< RC1STA
+        unsigned PSMC1LD:1; ///< PSMC1CON
+    }xc_stub_bits_type;
+    
+    extern volatile xc_stub_bits_type   OSCCONbits, ADCON0bits, ADCON1bits, ADCON2bits, RC1STAbits, PSMC1CONbits;
+    
+    extern uint8_t                      xc_stub_eeprom[256]; ///< Data EEPROM, starts erased (0xFF)
+    uint8_t eeprom_read(uint8_t address);
+    void eeprom_write(uint8_t address, uint8_t value);
+
+#endif /* XC_STUB_H */
@@ -0,0 +1,25 @@
+/**
+ * @file xc_stub.c
+ * @brief Definitions of the registers declared by the host xc.h, and a data EEPROM in RAM.
+ */
+
+#include <xc.h>
+
+#define     XC_STUB_DEFINE(name)    volatile uint8_t name;
+XC_STUB_REGISTERS(XC_STUB_DEFINE)
+
+volatile xc_stub_bits_type          OSCCONbits, ADCON0bits, ADCON1bits, ADCON2bits, RC1STAbits, PSMC1CONbits;
+
+void                                (*xc_stub_delay)(unsigned ms) = NULL;
+uint8_t                             xc_stub_eeprom[256] = { [0 ... 255] = 0xFF };
+void                                (*xc_stub_idle)(void) = NULL;
+
+uint8_t eeprom_read(uint8_t address)
+{
+    return xc_stub_eeprom[address];
+}
+
+void eeprom_write(uint8_t address, uint8_t value)
+{
+    xc_stub_eeprom[address] = value;
+}
@@ -0,0 +1,15 @@
+/**
+ * @file test.h
+ * @brief Minimal checks for the host unit tests: #CHECK counts and prints the failures, #TEST_END returns them.
+ */
+#ifndef TEST_H
+#define TEST_H
+
+    #include <stdio.h>
+
+    static int                          test_failures = 0;
+
+    #define     CHECK(cond, ...)        do { if (!(cond)) { test_failures++; printf("%s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+    #define     TEST_END(name)          ( printf("%s: %s\n", name, test_failures ? "FAIL" : "ok"), test_failures != 0 )
+
+#endif /* TEST_H */
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Runs the orchestrator on three emulated boards, 20 times faster than real time, for 3 s: 1 min of charge.
+# Checks that every board ran its setup, that no byte was dropped, and that the columns of each log are
+# complete and hold a running CC charge at the current setpoint.
+#
+#   sh test/test_orchestrator.sh [build directory]
+
+set -e
+build=${1:-build}
+dir=$(mktemp -d)
+pids=
+trap 'kill $pids 2>/dev/null; rm -rf "$dir"' EXIT
+fail() {
+    echo "test_orchestrator: $*" >&2
+    exit 1
+}
+
+for k in 0 1 2; do
+    "$build/emulator" -x 20 -s $((20 + 20 * k)) -l "$dir/tty$k" > /dev/null &
+    pids="$pids $!"
+done
+for k in 0 1 2; do
+    n=0
+    while [ ! -e "$dir/tty$k" ]; do
+        n=$((n + 1))
+        [ $n -lt 100 ] || fail "emulator $k did not start"
+        sleep 0.05
+    done
+done
+
+"$build/orchestrator" -o "$dir/log" -p 50 -t 3 -c "$(dirname "$0")/orchestrator_setup.txt" \
+    "$dir/tty0" "$dir/tty1" "$dir/tty2" > "$dir/summary" || fail "orchestrator failed: $(cat "$dir/summary")"
+
+for k in 0 1 2; do
+    line=$(grep "^board=$k " "$dir/summary") || fail "no summary of board $k"
+    uart=${line##* uart=}
+    case "$uart" in
+        *[!0,]*) fail "bytes dropped: $line" ;;
+    esac
+    log="$dir/log/b$k"
+    rows=
+    while read -r name type; do
+        size=$(wc -c < "$log/$name")
+        count=$((size * 8 / ${type#u}))
+        [ -z "$rows" ] || [ "$count" = "$rows" ] || fail "board $k: $name has $count rows, not $rows"
+        rows=$count
+    done < "$log/schema.txt"
+    [ "$rows" -ge 20 ] || fail "board $k: $rows rows"
+    "$build/orchestrator" -r "$log" | awk -F, -v k=$k '
+        NR == 1 { for (i = 1; i <= NF; i++) col[$i] = i; next }
+        { last = $0; n = split($0, v, ",") }
+        END {
+            split(last, v, ",")
+            if (v[col["status"]] != 5) { print "board " k ": status " v[col["status"]] ", not a running CC charge"; exit 1 }
+            if (v[col["current"]] < 950 || v[col["current"]] > 1050) { print "board " k ": current " v[col["current"]]; exit 1 }
+            if (v[col["voltage"]] < 3000 || v[col["voltage"]] > 4250) { print "board " k ": voltage " v[col["voltage"]]; exit 1 }
+            if (v[col["fault"]] != 0) { print "board " k ": fault " v[col["fault"]]; exit 1 }
+        }' >&2 || fail "board $k: bad log"
+done
+echo "test_orchestrator: $(grep -c '^board=' "$dir/summary") boards, $(sed -n 's/.* rows=\([0-9]*\).* depth_max=\([0-9]*\).*/\1 rows depth \2/p' "$dir/summary" | tr '\n' ' ')"
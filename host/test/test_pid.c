@@ -0,0 +1,159 @@
+/**
+ * @file test_pid.c
+ * @brief Checks the fixed-point #pid against the float controller it replaced.
+ * <ol> <li> The float reference is the former float pid() of the baseline, unchanged. It has no integral limit
+ * and no anti-windup, so the two only agree while neither limit acts: each run checks that the duty never
+ * reaches #DC_MIN or #DC_MAX and that #ctrl.pidi never reaches #PID_I_LIMIT, so the comparison is valid
+ * <li> Both run in closed loop on their own copy of a first order plant through setpoint steps, with the
+ * gains of each mode. The plants take #ctrl.pidt and the float duty, before the dither and the truncation,
+ * so only the arithmetic is compared. #ctrl.pidt must stay within a quarter of a duty count of the reference and both must settle
+ * on the same feedback
+ * <li> The gains are limited by #set_gains so the derivative product does not wrap with the largest
+ * error step </ol>
+ */
+
+#include <math.h>
+#include <string.h>
+#include "test.h"
+#include "charger_discharger.h"
+
+#define     TEST_CYCLES             4000 ///< Control cycles of each closed loop run
+#define     TEST_DUTY               175 ///< Operating point, halfway between #DC_MIN and #DC_MAX
+#define     TEST_STEP               100 ///< Setpoint steps around the operating point, in ADC counts, small enough that no limit acts
+#define     TEST_TOLERANCE          0.25 ///< Largest difference between #ctrl.pidt and the reference, duty counts
+
+/** @brief State of the float reference controller*/
+typedef struct {
+    float pidt;
+    float pidi;
+    float er;
+}pid_ref_type;
+
+/** @brief First order plant: the feedback follows gain * (duty - offset) with a pole of @p pole per cycle*/
+typedef struct {
+    double y;
+    double gain;
+    double offset;
+    double pole;
+}test_plant_type;
+
+/**@brief This function is the float controller of the baseline, with the gains of #ctrl converted back to float
+*/
+static void pid_ref(pid_ref_type* r, float feedback, float setpoint)
+{
+    float       kp = ctrl.kp / 16777216.0f;
+    float       ki = ctrl.ki / 16777216.0f;
+    float       kd = ctrl.kd / 65536.0f;
+
+    r->pidt += kd * (setpoint - feedback - r->er);
+    
+    r->er = setpoint - feedback;
+    if(r->er > ERR_MAX) r->er = ERR_MAX;
+    if(r->er < ERR_MIN) r->er = ERR_MIN;
+    
+    r->pidi += (ki * r->er);
+    r->pidt += (r->er * kp + r->pidi);
+    
+    if (r->pidt >= DC_MAX) r->pidt = DC_MAX;
+    else if (r->pidt <= DC_MIN) r->pidt = DC_MIN;
+}
+
+/**@brief This function advances the plant with @p duty and returns the feedback in ADC counts
+*/
+static uint16_t plant_tick(test_plant_type* p, double duty)
+{
+    double      target = p->gain * (duty - p->offset);
+
+    if (target < 0) target = 0;
+    p->y += (target - p->y) * p->pole;
+    if (p->y > ADC_MAX) return ADC_MAX;
+    return (uint16_t) floor(p->y + 0.5);
+}
+
+/**@brief This function runs both controllers with the gains of #set_gains in the mode of @p cmode and @p dmode
+*/
+static void test_closed_loop(const char* name, bool cmode, bool dmode, double gain, double offset)
+{
+    pid_ref_type        ref = { TEST_DUTY, 0, 0 };
+    test_plant_type     pf = { gain * (TEST_DUTY - offset), gain, offset, 0.3 };
+    test_plant_type     pr = pf;
+    uint16_t            y0 = (uint16_t) floor(pf.y + 0.5);
+    uint16_t            yf = y0;
+    uint16_t            yr = y0;
+    uint16_t            setpoint;
+    double              dev = 0;
+    double              d;
+    bool                limited = false;
+    int                 k;
+
+    ctrl.cmode = cmode;
+    ctrl.dmode = dmode;
+    set_gains();
+    ctrl.pidt = PID_Q16(TEST_DUTY);
+    ctrl.pidi = 0;
+    ctrl.er = 0;
+    ctrl.dc_dither = 0;
+    ctrl.ss_limit = PID_Q16(DC_MAX);
+    for (k = 0; k < TEST_CYCLES; k++)
+    {
+        setpoint = y0 + (k < TEST_CYCLES / 2 ? TEST_STEP : -TEST_STEP); /// A step up from the operating point and a step down
+        pid(yf, setpoint);
+        pid_ref(&ref, yr, setpoint);
+        yf = plant_tick(&pf, ctrl.pidt / 65536.0);
+        yr = plant_tick(&pr, ref.pidt);
+        d = fabs(ctrl.pidt / 65536.0 - ref.pidt);
+        if (d > dev) dev = d;
+        if (ctrl.pidt <= PID_Q16(DC_MIN) || ctrl.pidt >= PID_Q16(DC_MAX) || labs(ctrl.pidi) >= PID_I_LIMIT
+            || ref.pidt <= DC_MIN || ref.pidt >= DC_MAX) limited = true;
+    }
+    printf("%s: largest difference %.3f duty counts, feedback %u and %u\n", name, dev, yf, yr);
+    CHECK(!limited, "%s: a limit acted, the float reference does not have them", name);
+    CHECK(dev <= TEST_TOLERANCE, "%s: pidt differs from the float reference by %.3f counts", name, dev);
+    CHECK(abs( (int) yf - (int) yr ) <= 1 && abs( (int) yf - (int) (y0 - TEST_STEP) ) <= 7, "%s: settled at %u, the reference at %u", name, yf, yr);
+}
+
+/**@brief This function checks the gain limits of #set_gains and that the largest error step saturates #pid
+* at the right end instead of wrapping
+*/
+static void test_limits()
+{
+    int32_t     cv_kd = CV_kd;
+    int32_t     cv_kp = CV_kp;
+    uint8_t     cc_kd = CC_char_disc_kd;
+
+    CV_kd = PID_MILLI_TO_Q16(100000); /// The largest CONF:CVKD before the limit
+    CV_kp = -1;
+    ctrl.cmode = 0;
+    set_gains();
+    CHECK(ctrl.kd == PID_KD_MAX, "CV kd %ld not limited", (long) ctrl.kd);
+    CHECK(ctrl.kp == 0, "negative kp %ld not cleared", (long) ctrl.kp);
+    CC_char_disc_kd = 255;
+    ctrl.cmode = 1;
+    set_gains();
+    CHECK(ctrl.kd == PID_KD_MAX, "CC kd %ld not limited", (long) ctrl.kd);
+    
+    ctrl.ss_limit = PID_Q16(DC_MAX);
+    ctrl.pidt = PID_Q16(DC_MAX);
+    ctrl.pidi = PID_I_LIMIT;
+    ctrl.er = ERR_MIN;
+    CHECK(pid(0, ADC_MAX) >= DC_MAX, "largest positive step did not saturate at DC_MAX");
+    ctrl.pidt = PID_Q16(DC_MIN);
+    ctrl.pidi = -PID_I_LIMIT;
+    ctrl.er = ERR_MAX;
+    CHECK(pid(ADC_MAX, 0) == DC_MIN, "largest negative step did not saturate at DC_MIN");
+    CV_kd = cv_kd;
+    CV_kp = cv_kp;
+    CC_char_disc_kd = cc_kd;
+}
+
+int main()
+{
+    test_closed_loop("CC charge", 1, 0, 6.0, 40);
+    test_closed_loop("CC discharge", 1, 1, 4.0, 20);
+    test_closed_loop("CV", 0, 0, 5.0, 30);
+    CV_kd = PID_Q16(0.1);
+    test_closed_loop("CV kd 0.1", 0, 0, 5.0, 30);
+    CV_kd = PID_Q16(0.020);
+    test_limits();
+    return TEST_END("test_pid");
+}
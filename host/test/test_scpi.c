@@ -0,0 +1,396 @@
+/**
+ * @file test_scpi.c
+ * @brief Runs every entry of #scpi_commands through #command_interpreter.
+ * <ol> <li> Dispatch: the long form, the short form and the lower case form of every header, with its
+ * number of arguments and with trailing spaces and tabs, must reach that entry and no other
+ * <li> Bad arguments: a missing, extra, non numeric or too long argument, and an argument given to a command
+ * without arguments, must be rejected before the handler runs
+ * <li> Execution: #test_lines holds a line for every entry, sent in order to a simulated board with the
+ * status byte it must return. An entry without a line fails the test
+ * <li> The end limits changed by a profile are restored when it stops, and no profile or session starts while the relays switch
+ * <li> The time of a scheduled cell covers every step of its profile
+ * <li> A UART overrun is counted by DIAG:UART? and sends no text </ol>
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "test.h"
+#include "board.h"
+#include "charger_discharger.h"
+
+void ISR(void); /// Interrupt service routine of main.c
+
+/** @brief A command line and the status byte it must return*/
+typedef struct {
+    const char* pattern; ///< Entry of #scpi_commands it runs
+    const char* line;
+    int status;
+    uint16_t wait; ///< Control cycles to run before the line
+    void (*setup)(void); ///< Change to the plant before the wait, if any
+}test_line_type;
+
+/**@brief Setup of CAL:VOLT:HIGH, charge the cell*/
+static void test_cell_charged()
+{
+    board_plant.soc = 0.9;
+}
+
+/**@brief Setup of CAL:TEMP:HIGH, heat the cell*/
+static void test_cell_hot()
+{
+    board_plant.temperature = 60;
+}
+
+/**@brief Setup of the PROT:CLE after CAL:TEMP:HIGH, cool the cell so the overtemperature fault can be cleared*/
+static void test_cell_cool()
+{
+    board_plant.temperature = 25;
+}
+
+/** Lines sent in order to the board, at least one for every entry of #scpi_commands*/
+static const test_line_type test_lines[] = {
+    { "*IDN?",                  "*IDN?",                    1 },
+    { "MEASure:VOLTage?",       "MEAS:VOLT?",               1 },
+    { "MEASure:CURRent?",       "meas:curr?",               1 },
+    { "MEASure:CAPacity?",      "MEASURE:CAPACITY?",        1 },
+    { "MEASure:ALL?",           "MEAS:ALL?",                1 },
+    { "MEASure:COULomb?",       "MEAS:COUL?",               1 },
+    { "MEASure:TEMPerature?",   "MEAS:TEMP?",               1 },
+    { "VOLTage",                "VOLT 4200",                1 },
+    { "CURRent",                "CURR 500",                 1 },
+    { "CURRent",                "CURR -1",                  0 },
+    { "VOLTage:PROTection",     "VOLT:PROT 4500",           1 },
+    { "VOLTage:PROTection:LOW", "VOLT:PROT:LOW 2500",       1 },
+    { "CURRent:PROTection",     "CURR:PROT 3000",           1 },
+    { "PROTection:DEBounce",    "PROT:DEB 4",               1 },
+    { "PROTection:DEBounce",    "PROT:DEB 0",               0 },
+    { "PROTection:FAULt?",      "PROT:FAUL?",               1 },
+    { "PROTection:CLEar",       "PROT:CLE",                 1 },
+    { "VOLTage:ENDCharge",      "VOLT:ENDC 0",              1 },
+    { "CURRent:ENDCharge",      "CURR:ENDC 100",            1 },
+    { "VOLTage:ENDDischarge",   "VOLT:ENDD 3000",           1 },
+    { "CONFigure:CVKP",         "CONF:CVKP 1800",           1 },
+    { "CONFigure:CVKP",         "CONF:CVKP 100001",         0 },
+    { "CONFigure:CVKI",         "CONF:CVKI 500",            1 },
+    { "CONFigure:CVKD",         "CONF:CVKD 20",             1 },
+    { "CONFigure:CVKD",         "CONF:CVKD 4001",           0 },
+    { "CONFigure:CCCP",         "CONF:CCCP 3000",           1 },
+    { "CONFigure:CCCI",         "CONF:CCCI 500",            1 },
+    { "CONFigure:CCDP",         "CONF:CCDP 6000",           1 },
+    { "CONFigure:CCDI",         "CONF:CCDI 1000",           1 },
+    { "FEED:BUS",               "FEED:BUS 8000",            1 },
+    { "FEED:RESistance",        "FEED:RES 130",             1 },
+    { "FEED:SLEW",              "FEED:SLEW 128",            1 },
+    { "FEED:SLEW",              "FEED:SLEW 0",              0 },
+    { "FEED:DUTY?",             "FEED:DUTY?",               1 },
+    { "TEMPerature:PROTection", "TEMP:PROT 600",            1 },
+    { "TEMPerature:DERating",   "TEMP:DER 450",             1 },
+    { "ADC:RATE",               "ADC:RATE 0,16",            1 },
+    { "FILTer:TYPE",            "FILT:TYPE 0",              1 },
+    { "FILTer:WINDow",          "FILT:WIND 64",             1 },
+    { "TELEMetry:PERiod",       "TELEM:PER 100",            1 },
+    { "TELEMetry:STATe",        "TELEM:STAT 0",             1 },
+    { "TELEMetry:STATe",        "TELEM:STAT 2",             0 },
+    { "LOG:STATe",              "LOG:STAT 1",               1 },
+    { "LOG:DECimation",         "LOG:DEC 1",                1 },
+    { "LOG:CLEar",              "LOG:CLE",                  1 },
+    { "MODE:CHARge",            "MODE:CHAR",                1 },
+    { "MODE:DISCharge",         "MODE:DISC",                0 }, /// The relays of MODE:CHAR are switching
+    { "OUTPut:START",           "OUTP:START",               0 },
+    { "OUTPut:START",           "OUTP:START",               1, 600, NULL },
+    { "TUNE:STATe?",            "TUNE:STAT?",               1 },
+    { "TUNE:START",             "TUNE:START 10",            1, 1025, NULL },
+    { "TUNE:RESult?",           "TUNE:RES?",                1, 2050, NULL },
+    { "TUNE:APPLy",             "TUNE:APPL",                1 },
+    { "LOG:STATus?",            "LOG:STAT?",                1 },
+    { "LOG:DATA?",              "LOG:DATA? 0",              1 },
+    { "OUTPut:STOP",            "OUTP:STOP",                1 },
+    { "MODE:DISCharge",         "MODE:DISC",                1, 200, NULL },
+    { "CALibrate:VOLTage:LOW",  "CAL:VOLT:LOW 3000",        1, 2050, NULL },
+    { "CALibrate:VOLTage:HIGH", "CAL:VOLT:HIGH 4200",       1, 2050, test_cell_charged },
+    { "CALibrate:CURRent:LOW",  "CAL:CURR:LOW 0",           1 },
+    { "CALibrate:CURRent:HIGH", "CAL:CURR:HIGH 1000",       0 }, /// No current flows, the counts are the ones of the low point
+    { "CALibrate:TEMPerature:LOW", "CAL:TEMP:LOW 250",      1 },
+    { "CALibrate:TEMPerature:HIGH", "CAL:TEMP:HIGH 600",    1, 2050, test_cell_hot },
+    { "CALibrate:DATA?",        "CAL:DATA?",                1 },
+    { "CALibrate:RESet",        "CAL:RES",                  1 },
+    { "CONFigure:SAVE",         "CONF:SAVE",                1 },
+    { "CONFigure:RECall",       "CONF:REC",                 1 },
+    { "PROFile:STEP",           "PROF:STEP 0,1,500,4200",   1 },
+    { "PROFile:STEP",           "PROF:STEP 1,9,0,0",        0 },
+    { "PROFile:STEP",           "PROF:STEP 1,4,0,256",      0 }, /// The loop counter is 8-bit
+    { "PROFile:STEP?",          "PROF:STEP? 0",             1 },
+    { "PROFile:STATe?",         "PROF:STAT?",               1 },
+    { "PROFile:RUN",            "PROF:RUN",                 1 },
+    { "PROFile:STOP",           "PROF:STOP",                1 },
+    { "PROTection:CLEar",       "PROT:CLE",                 1, 2050, test_cell_cool }, /// A latched fault would stop the profile and the session
+    { "SCHEDule:CELLs",         "SCHED:CELL 3",             1 },
+    { "SCHEDule:CELLs",         "SCHED:CELL 16",            0 },
+    { "SCHEDule:PROFile",       "SCHED:PROF 0",             1 },
+    { "SCHEDule:START",         "SCHED:START",              1 },
+    { "SCHEDule:STOP",          "SCHED:STOP",               1 },
+    { "SCHEDule:RESult?",       "SCHED:RES?",               1 },
+    { "DIAGnostic:TIMing?",     "DIAG:TIM?",                1 },
+    { "DIAGnostic:TIMing:RESet","DIAG:TIM:RES",             1 },
+    { "DIAGnostic:TASK?",       "DIAG:TASK?",               1 },
+    { "DIAGnostic:UART?",       "DIAG:UART?",               1 },
+    { NULL,                     "MEAS:NOTHING?",            0 },
+    { NULL,                     "",                         0 },
+};
+
+/**@brief This function writes the form of @p pattern with every node in short form, or in long form in
+* lower case, followed by @p suffix
+*/
+static void test_form(char* out, const char* pattern, bool full, const char* suffix)
+{
+    bool        node_short = 1;
+
+    for (; *pattern; pattern++)
+    {
+        if (*pattern == ':' || *pattern == '?') node_short = 1;
+        else if (islower(*pattern)) node_short = 0;
+        if (full) *out++ = (char) tolower(*pattern);
+        else if (node_short || *pattern == ':' || *pattern == '?') *out++ = *pattern;
+    }
+    strcpy(out, suffix);
+}
+
+/**@brief This function returns the entry of #scpi_commands that runs @p line, as #command_interpreter
+* finds it, or -1
+*/
+static int test_dispatch(const char* line)
+{
+    char        buffer[UART_LINE_SIZE * 2];
+    char*       arg;
+    uint8_t     k;
+
+    for (k = 0; k < scpi_command_count; k++)
+    {
+        strcpy(buffer, line);
+        arg = scpi_match(scpi_commands[k].pattern, buffer);
+        if (arg == NULL) continue;
+        return scpi_parse_numbers(arg, scpi_args, scpi_commands[k].flags & SCPI_ARGS_MASK) ? k : -1;
+    }
+    return -1;
+}
+
+/**@brief This function checks the dispatch and the bad arguments of every entry
+*/
+static void test_parser()
+{
+    static const char* args[] = { "", " 7", " 7,-8", "", " 7,-8,9,10" };
+    static const char* tails[] = { "", " ", "  \t" };
+    char        line[UART_LINE_SIZE * 2];
+    char        suffix[24];
+    uint8_t     k;
+    uint8_t     n;
+    uint8_t     form;
+    uint8_t     tail;
+
+    for (k = 0; k < scpi_command_count; k++)
+    {
+        n = scpi_commands[k].flags & SCPI_ARGS_MASK;
+        for (form = 0; form < 2; form++)
+        {
+            for (tail = 0; tail < sizeof(tails) / sizeof(tails[0]); tail++) /// Right arguments, with trailing whitespace
+            {
+                snprintf(suffix, sizeof(suffix), "%s%s", args[n], tails[tail]);
+                test_form(line, scpi_commands[k].pattern, form, suffix);
+                CHECK(test_dispatch(line) == k, "'%s' does not run %s", line, scpi_commands[k].pattern);
+            }
+            if (n)
+            {
+                test_form(line, scpi_commands[k].pattern, form, ""); /// Missing arguments
+                CHECK(!command_interpreter(line), "'%s' accepted without arguments", line);
+                snprintf(suffix, sizeof(suffix), "%s,1", args[n]); /// One too many
+                test_form(line, scpi_commands[k].pattern, form, suffix);
+                CHECK(!command_interpreter(line), "'%s' accepted", line);
+                test_form(line, scpi_commands[k].pattern, form, n > 1 ? " 1,x" : " x"); /// Not a number
+                CHECK(!command_interpreter(line), "'%s' accepted", line);
+                test_form(line, scpi_commands[k].pattern, form, " 1234567890"); /// More digits than #SCPI_MAX_DIGITS
+                CHECK(!command_interpreter(line), "'%s' accepted", line);
+                test_form(line, scpi_commands[k].pattern, form, " 1 2"); /// No comma
+                CHECK(!command_interpreter(line), "'%s' accepted", line);
+            }
+            else
+            {
+                test_form(line, scpi_commands[k].pattern, form, " 1"); /// An argument to a command without them
+                CHECK(!command_interpreter(line), "'%s' accepted", line);
+            }
+            test_form(line, scpi_commands[k].pattern, form, "\xA0"); /// A byte above 0x7F after the header
+            CHECK(!command_interpreter(line), "'%s' accepted", line);
+            line[0] = (char) ( line[0] | 0x80 ); /// And in the header
+            CHECK(!command_interpreter(line), "'%s' accepted", line);
+        }
+    }
+}
+
+/**@brief This function sends #test_lines to a simulated board and checks that every entry has a line
+*/
+static void test_execution()
+{
+    char        reply[64];
+    uint8_t     k;
+    uint8_t     j;
+    bool        found;
+    int         status;
+
+    board_init();
+    board_plant.soc = 0.5;
+    board_run(1025);
+    for (j = 0; j < sizeof(test_lines) / sizeof(test_lines[0]); j++)
+    {
+        if (test_lines[j].setup) test_lines[j].setup();
+        board_run(test_lines[j].wait);
+        status = board_command(test_lines[j].line, reply, sizeof(reply));
+        CHECK(status == test_lines[j].status, "'%s' returned %d, expected %d, reply '%s'", test_lines[j].line, status, test_lines[j].status, reply);
+        if (test_lines[j].pattern)
+        {
+            CHECK(test_dispatch(test_lines[j].line) == -1 ? test_lines[j].status == 0 :
+                !strcmp(scpi_commands[test_dispatch(test_lines[j].line)].pattern, test_lines[j].pattern),
+                "'%s' is not %s", test_lines[j].line, test_lines[j].pattern);
+        }
+    }
+    for (k = 0; k < scpi_command_count; k++)
+    {
+        found = 0;
+        for (j = 0; j < sizeof(test_lines) / sizeof(test_lines[0]); j++)
+        {
+            if (test_lines[j].pattern && !strcmp(test_lines[j].pattern, scpi_commands[k].pattern)) found = 1;
+        }
+        CHECK(found, "%s has no test line", scpi_commands[k].pattern);
+    }
+}
+
+/**@brief This function checks that the limits changed by the profile steps are restored when it ends
+*/
+static void test_profile_limits()
+{
+    static const char* lines[] = { "OUTP:STOP", "VOLT:ENDD 3000", "CURR:ENDC 100", "VOLT:ENDC 0", "PROF:STEP 0,5,200,4100",
+        "PROF:STEP 1,2,500,3300", "PROF:STEP 2,0,0,0" };
+    uint8_t     k;
+
+    board_run(1100); /// SCHED:STOP ends the session on the next second, once the relays are off
+    for (k = 0; k < sizeof(lines) / sizeof(lines[0]); k++) CHECK(board_command(lines[k], NULL, 0) == 1, "'%s' failed", lines[k]);
+    board_run(600); /// PROF:RUN waits for the relays of OUTP:STOP
+    CHECK(board_command("PROF:RUN", NULL, 0) == 1, "PROF:RUN failed");
+    CHECK(v_endd == 3300 && i_endc == 200 && v_endc == 4100, "the profile steps did not set the limits");
+    CHECK(board_command("PROF:STOP", NULL, 0) == 1, "PROF:STOP failed");
+    CHECK(v_endd == 3000 && i_endc == 100 && v_endc == 0, "limits %u %u %u not restored", v_endd, i_endc, v_endc);
+}
+
+/**@brief This function checks that a profile or a session is not started while the relays of MODE:CHAR are switching
+*/
+static void test_relays_busy()
+{
+    board_run(1100);
+    CHECK(board_command("SCHED:CELL 1", NULL, 0) == 1, "SCHED:CELL 1 failed");
+    CHECK(board_command("MODE:CHAR", NULL, 0) == 1, "MODE:CHAR failed");
+    CHECK(board_command("PROF:RUN", NULL, 0) == 0 && !prof_active, "PROF:RUN started while the relays switch");
+    CHECK(board_command("SCHED:START", NULL, 0) == 0 && !sched_active, "SCHED:START started while the relays switch");
+    CHECK(!relay_ready(), "the relays were done before the test lines");
+    board_run(600);
+}
+
+/**@brief This function checks that the time of a scheduled cell covers every step of its profile, not only the last one
+*/
+static void test_schedule_time()
+{
+    static const char* lines[] = { "PROF:STEP 0,5,0,3800", "PROF:STEP 1,1,500,4200", "PROF:STEP 2,3,20,0",
+        "PROF:STEP 3,1,500,4200", "PROF:STEP 4,0,0,0", "SCHED:CELL 1", "SCHED:PROF 1", "SCHED:START" };
+    uint32_t    start;
+    uint32_t    elapsed;
+    uint8_t     k;
+
+    board_plant.soc = 0.5;
+    for (k = 0; k < sizeof(lines) / sizeof(lines[0]); k++) CHECK(board_command(lines[k], NULL, 0) == 1, "'%s' failed", lines[k]);
+    start = board_ticks;
+    while (sched_active && board_ticks - start < 3600 * 1025) board_tick();
+    elapsed = (board_ticks - start) / 1025;
+    CHECK(cell_results[0].status == CELL_DONE, "the cell ended with status %u", cell_results[0].status);
+    CHECK(elapsed > 20 && cell_results[0].time + 2 >= elapsed && cell_results[0].time <= elapsed + 2,
+        "the cell took %u s but its result is %u s", (unsigned) elapsed, cell_results[0].time);
+}
+
+/**@brief This function checks that the RAM log keeps #LOG_BLOCKS full blocks of a steady charge, and that LOG:DATA?
+* rebuilds every record from its changes
+*/
+static void test_log()
+{
+    static const char* lines[] = { "LOG:CLE", "LOG:DEC 1", "LOG:STAT 1", "MODE:CHAR" };
+    log_data_type   records[64];
+    char            reply[LOG_BURST * LOG_LINE_MAX];
+    char            command[16];
+    char*           line;
+    char*           end;
+    unsigned        f[6];
+    uint16_t        next;
+    uint16_t        from;
+    uint8_t         n;
+    uint8_t         k;
+
+    for (k = 0; k < sizeof(lines) / sizeof(lines[0]); k++) CHECK(board_command(lines[k], NULL, 0) == 1, "'%s' failed", lines[k]);
+    board_run(600);
+    CHECK(board_command("OUTP:START", NULL, 0) == 1, "OUTP:START failed");
+    while (log_sequence < 48) /// Keep every record as it is stored
+    {
+        next = log_sequence;
+        board_tick();
+        if (log_sequence != next) records[next] = log_last;
+    }
+    CHECK(board_command("OUTP:STOP", NULL, 0) == 1, "OUTP:STOP failed");
+    from = log_blocks[(uint8_t) (log_head + 1 - log_used) & LOG_MASK].sequence;
+    CHECK(log_sequence - from >= LOG_BLOCKS * (LOG_DELTAS + 1) - LOG_DELTAS, "the log only keeps %u records", log_sequence - from);
+    do /// Read it back in bursts from the oldest record
+    {
+        snprintf(command, sizeof(command), "LOG:DATA? %u", from);
+        CHECK(board_command(command, reply, sizeof(reply)) == 1, "'%s' failed", command);
+        n = 0;
+        for (line = reply; (end = strchr(line, '\n')) != NULL; line = end + 1)
+        {
+            CHECK(sscanf(line, "%u,%u,%u,%u,%u,%u", &f[0], &f[1], &f[2], &f[3], &f[4], &f[5]) == 6 && f[0] == from, "bad line '%s'", line);
+            CHECK(f[2] == records[from].voltage && f[3] == records[from].current && f[4] == records[from].capacity && f[5] == records[from].temperature,
+                "record %u is %u,%u,%u,%u instead of %u,%u,%u,%u", from, f[2], f[3], f[4], f[5],
+                records[from].voltage, records[from].current, records[from].capacity, records[from].temperature);
+            from++;
+            n++;
+        }
+    } while (n && from < log_sequence);
+    CHECK(from == log_sequence, "LOG:DATA? stopped at record %u of %u", from, log_sequence);
+}
+
+/**@brief This function raises a UART overrun in the ISR and checks that it is counted in the last field of DIAG:UART?
+* and that no byte is sent for it
+*/
+static void test_uart_overrun()
+{
+    char        reply[64];
+    char*       field;
+    uint8_t     byte;
+
+    board_run(100);
+    while (board_fifo_get(&board_tx, &byte));
+    RC1STAbits.OERR = 1;
+    RCIF = 1;
+    ISR();
+    RCIF = 0;
+    RC1STAbits.OERR = 0;
+    board_run(10);
+    CHECK(!board_fifo_get(&board_tx, &byte), "the overrun sent 0x%02X", byte);
+    CHECK(board_command("DIAG:UART?", reply, sizeof(reply)) == 1, "DIAG:UART? failed");
+    field = strrchr(reply, ',');
+    CHECK(field && atoi(field + 1) == 1, "DIAG:UART? returned '%s' after an overrun", reply);
+}
+
+int main()
+{
+    test_parser();
+    test_execution();
+    test_profile_limits();
+    test_relays_busy();
+    test_schedule_time();
+    test_log();
+    test_uart_overrun();
+    return TEST_END("test_scpi");
+}
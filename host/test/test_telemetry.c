@@ -0,0 +1,129 @@
+/**
+ * @file test_telemetry.c
+ * @brief Decodes the binary telemetry of a simulated board while command lines are sent to it.
+ * <ol> <li> Every byte received while the telemetry is on must belong to a frame between two 0x00 bytes,
+ * with a valid COBS encoding and CRC
+ * <li> The status of every line must come back in a status frame, in order, and the queries must be refused
+ * <li> The measurement frames must keep their sequence, and no frame may follow the status of TELEM:STAT 0 </ol>
+ */
+
+#include <string.h>
+#include "test.h"
+#include "board.h"
+#include "charger_discharger.h"
+
+#define     TEST_GAP                37 ///< Control cycles between the lines, not a multiple of the telemetry period
+#define     TEST_RX_SIZE            32768 ///< Bytes of the capture
+
+/** @brief A command line and the status it must return in its status frame*/
+typedef struct {
+    const char* line;
+    int status;
+}test_frame_line_type;
+
+/** Lines sent while the telemetry is on, the last one turns it off*/
+static const test_frame_line_type test_lines[] = {
+    { "CURR 500",               1 },
+    { "CURR -1",                0 },
+    { "MEAS:VOLT?",             0 }, /// Queries are refused, their text would mix with the frames
+    { "DIAG:UART?",             0 },
+    { "nonsense",               0 },
+    { "",                       0 },
+    { "VOLT:PROT 4500",         1 },
+    { "TELEM:PER 16",           1 },
+    { "FILT:TYPE 1",            1 },
+    { "TELEM:STAT 0",           1 },
+};
+
+static uint8_t                      test_rx[TEST_RX_SIZE];
+
+/**@brief This function decodes one COBS chunk
+* @return decoded length, or -1 if the encoding is not valid
+*/
+static int test_cobs_decode(const uint8_t* in, int length, uint8_t* out)
+{
+    int         k = 0;
+    int         n = 0;
+    int         j;
+    uint8_t     code;
+
+    while (k < length)
+    {
+        code = in[k++];
+        if (!code || k + code - 1 > length) return -1;
+        for (j = 1; j < code; j++) out[n++] = in[k++];
+        if (code < 0xFF && k < length) out[n++] = 0;
+    }
+    return n;
+}
+
+int main()
+{
+    uint8_t     raw[256];
+    uint8_t     sequence = 0;
+    uint8_t     byte;
+    uint16_t    crc;
+    bool        first = 1;
+    bool        off = 0;
+    int         length = 0;
+    int         start;
+    int         n;
+    int         k;
+    int         statuses = 0;
+    int         frames = 0;
+    uint32_t    t;
+
+    board_init();
+    board_plant.soc = 0.5;
+    board_run(1025);
+    CHECK(board_command("TELEM:PER 8", NULL, 0) == 1, "TELEM:PER 8 failed");
+    CHECK(board_command("TELEM:STAT 1", NULL, 0) == 1, "TELEM:STAT 1 did not return a bare status byte"); /// The telemetry was off when it arrived
+    for (t = 0; t < TEST_GAP * (sizeof(test_lines) / sizeof(test_lines[0]) + 10); t++)
+    {
+        if (t % TEST_GAP == 0 && t / TEST_GAP < sizeof(test_lines) / sizeof(test_lines[0]))
+        {
+            board_write(test_lines[t / TEST_GAP].line);
+            board_write("\n");
+        }
+        board_tick();
+        while (board_fifo_get(&board_tx, &byte) && length < TEST_RX_SIZE) test_rx[length++] = byte;
+    }
+    CHECK(length > 0 && test_rx[0] == 0, "the first byte after TELEM:STAT 1 is not a delimiter");
+    for (start = 0; start < length; start = k + 1) /// Split the capture at the delimiters
+    {
+        for (k = start; k < length && test_rx[k]; k++);
+        if (k == start) continue;
+        CHECK(k < length, "the capture ends inside a frame");
+        if (k == length) break;
+        n = test_cobs_decode(&test_rx[start], k - start, raw);
+        CHECK(n > 2, "%d bytes at offset %d are not a COBS frame", k - start, start);
+        if (n <= 2) continue;
+        crc = crc16((uint8_t) (n - 2), raw);
+        CHECK(raw[n - 2] == (uint8_t) crc && raw[n - 1] == (uint8_t) (crc >> 8), "bad CRC in the frame at offset %d", start);
+        CHECK(!off, "a frame follows the status of TELEM:STAT 0");
+        if (n == TELEM_STATUS_SIZE + 2 && raw[0] == TELEM_START && raw[1] == TELEM_STATUS)
+        {
+            CHECK(statuses < (int) (sizeof(test_lines) / sizeof(test_lines[0])), "more status frames than lines");
+            if (statuses >= (int) (sizeof(test_lines) / sizeof(test_lines[0]))) continue;
+            CHECK(raw[2] == test_lines[statuses].status, "'%s' returned %d, expected %d", test_lines[statuses].line, raw[2], test_lines[statuses].status);
+            off = !strcmp(test_lines[statuses].line, "TELEM:STAT 0");
+            statuses++;
+        }
+        else if (n == (int) sizeof(telem_frame_type) + 2 && raw[0] == TELEM_START && raw[1] == TELEM_OPERATION)
+        {
+            CHECK(first || raw[3] == sequence, "frame %u follows frame %u", raw[3], (uint8_t) (sequence - 1));
+            sequence = (uint8_t) (raw[3] + 1);
+            first = 0;
+            frames++;
+        }
+        else
+        {
+            CHECK(0, "unknown frame of %d bytes at offset %d", n, start);
+        }
+    }
+    CHECK(statuses == (int) (sizeof(test_lines) / sizeof(test_lines[0])), "%d status frames for %d lines", statuses, (int) (sizeof(test_lines) / sizeof(test_lines[0])));
+    CHECK(frames > 20, "only %d measurement frames", frames);
+    CHECK(telem_dropped == 0, "%u frames dropped", telem_dropped);
+    CHECK(board_command("MEAS:VOLT?", (char*) raw, sizeof(raw)) == 1, "queries are refused after TELEM:STAT 0");
+    return TEST_END("test_telemetry");
+}